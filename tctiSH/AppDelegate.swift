@@ -15,6 +15,15 @@ class AppDelegate: UIResponder, UIApplicationDelegate {
     var configServer : ConfigServer?
     var saving : Bool = false
 
+    /// Runs our background saves, and anything that has to wait for them; so they never hold up the main thread.
+    let saveQueue = DispatchQueue(label: "tctiSH.background-save", qos: .userInitiated)
+
+    /// The longest we'll let a background save run, however much background time iOS gives us.
+    private static let maxBackgroundSaveTime : TimeInterval = 25
+
+    /// How much of our background time we leave spare, for finishing up once a save's waits have run out.
+    private static let backgroundSaveMargin : TimeInterval = 5
+
     /// The controller used to support Picture in Picture.
     var pipController : AVPictureInPictureController?
 
@@ -24,6 +33,8 @@ class AppDelegate: UIResponder, UIApplicationDelegate {
     static var usingJitHacks = false
     static var isFirstBoot = false
     static var memoryValueChanged = false
+    static var cpuCountChanged = false
+    static var machineRevisionChanged = false
 
     func application(_ application: UIApplication, didFinishLaunchingWithOptions launchOptions: [UIApplication.LaunchOptionsKey: Any]?) -> Bool {
 
@@ -40,6 +51,18 @@ class AppDelegate: UIResponder, UIApplicationDelegate {
             "jit_mode": "jit_when_possible",
             "images": default_images,
             "memory": "1G",
+            "memory_balloon": true,
+            "memory_trim": true,
+            "cpu_count": "auto",
+            "tcg_thread_mode": "multi",
+            "extra_qemu_options": "",
+            "accel_properties": "",
+            "tb_size": "auto",
+            "disk_iothread": true,
+            "disk_cache_mode": "writeback",
+            "snapshot_mode": "state_file",
+            "snapshot_threads": "auto",
+            "new_disk_mode": "copy",
         ])
 
         // If we attempted a boot, but did not finish one, something went wrong last time.
@@ -56,9 +79,15 @@ class AppDelegate: UIResponder, UIApplicationDelegate {
         // Create a QEMU interface, which will launch our background kernel.
         qemu = QEMUInterface()
 
+        // Get our framework loading as early as we can; it's one of the slower parts of our launch,
+        // and it doesn't need to wait for anything else we do.
+        qemu!.prewarmFramework()
+
         // Figure out if our memory limit has changed, and thus we'll need to print a message.
         // This lets the user know to expect a delay, when appropriate.
         AppDelegate.memoryValueChanged = qemu!.memoryValueChanged()
+        AppDelegate.cpuCountChanged = qemu!.cpuCountChanged()
+        AppDelegate.machineRevisionChanged = qemu!.machineRevisionChanged()
         
         self.bootQemu()
 
@@ -76,6 +105,27 @@ class AppDelegate: UIResponder, UIApplicationDelegate {
     }
     
     
+    /// True once we've told the user their boot-only settings are waiting for our next launch.
+    private var pendingSettingsNoticeShown = false
+
+    /// How long we'll let QEMU take to shut down cleanly, when we're being terminated.
+    private static let shutdownTimeout : TimeInterval = 3
+
+    /// Lets the user know settings they've changed only apply at boot; so they're not left wondering why nothing
+    /// happened. QEMU can only be started once per process, so they'll apply the next time we're launched.
+    func noteSettingsPendingLaunch() {
+        if pendingSettingsNoticeShown {
+            return
+        }
+        pendingSettingsNoticeShown = true
+
+        if let term = ViewController.getCurrentTerminal() {
+            term.feed(text: "\r\n[tctiSH's memory or CPU settings have changed; they'll apply the next\r\n")
+            term.feed(text: " time tctiSH starts.]\r\n")
+        }
+    }
+
+
     func detectJit() {
         let settingsAllowJit = UserDefaults.standard.string(forKey: "jit_mode") == "jit_when_possible"
         
@@ -95,21 +145,97 @@ class AppDelegate: UIResponder, UIApplicationDelegate {
             return;
         }
 
+        // Let anything in the guest that cares know we're heading out; while it can still hear about it.
+        HostEvent.appBackground.post()
+
         if backgroundToPip() {
             NSLog("-----SWITCHED TO PIP-----")
             return();
         }
 
+        // Never take a snapshot before we've connected to our VM.
+        guard let qemu = qemu, ViewController.getCurrentTerminal()?.connected == true else {
+            return
+        }
+
+        // Ask iOS for time to save in, and make sure we're done with it before it runs out: our save gets
+        // a deadline inside that time, and if iOS wants it back early anyway, we give up on the save.
+        // Our task identifier is only ever touched from the main thread.
         saving = true
-        let taskIdentifier = application.beginBackgroundTask {}
-        qemu?.performBackgroundSave()
-        application.endBackgroundTask(taskIdentifier)
-        saving = false
+        var taskIdentifier = UIBackgroundTaskIdentifier.invalid
+        taskIdentifier = application.beginBackgroundTask(withName: "save VM state") {
+            qemu.cancelBackgroundSave()
+            application.endBackgroundTask(taskIdentifier)
+            taskIdentifier = .invalid
+        }
+
+        let available = min(application.backgroundTimeRemaining, AppDelegate.maxBackgroundSaveTime)
+        let deadline = Date().addingTimeInterval(available - AppDelegate.backgroundSaveMargin)
 
+        // Save off the main thread, so iOS doesn't kill us for not returning from here; and hand our time back once done.
+        saveQueue.async { [weak self] in
+            qemu.performBackgroundSave(deadline: deadline)
+
+            DispatchQueue.main.async {
+                self?.saving = false
+                if taskIdentifier != .invalid {
+                    application.endBackgroundTask(taskIdentifier)
+                    taskIdentifier = .invalid
+                }
+            }
+        }
 
         NSLog("-----BACKGROUNDED-----")
     }
 
+    func applicationWillEnterForeground(_ application: UIApplication) {
+
+        // If saving our state left the VM paused, let it pick up where it left off; once any save still
+        // in progress is done.
+        saveQueue.async { [weak self] in
+            self?.qemu?.resumeAfterBackgroundSave()
+
+            // Now that our latest save is safely in place, clear out any older ones we'll never resume from,
+            // and fold any disk layers it no longer needs back into our disk.
+            DispatchQueue.global(qos: .utility).async { [weak self] in
+                self?.qemu?.pruneSnapshots()
+                self?.qemu?.mergeDiskLayers()
+            }
+        }
+
+        // If the user changed settings that only apply at boot while we were away, they'll apply on our next launch;
+        // let them know. Memory changes that fit within what the guest booted with can be applied as it runs.
+        if qemu!.memoryValueChanged() || qemu!.cpuCountChanged() {
+            noteSettingsPendingLaunch()
+        } else {
+            qemu?.applyMemorySetting()
+        }
+
+        HostEvent.appForeground.post()
+    }
+
+    func applicationWillTerminate(_ application: UIApplication) {
+
+        // Shut QEMU down cleanly, so it flushes our disk; once any save in progress is done. Stopping blocks,
+        // so it happens off the main thread; and we only wait for it as long as iOS will let us.
+        let stopped = DispatchSemaphore(value: 0)
+        saveQueue.async { [weak self] in
+            _ = self?.qemu?.stopQemuThread()
+            stopped.signal()
+        }
+
+        if stopped.wait(timeout: .now() + AppDelegate.shutdownTimeout) == .timedOut {
+            NSLog("QEMU didn't shut down in time; exiting anyway")
+        }
+    }
+
+    func applicationDidReceiveMemoryWarning(_ application: UIApplication) {
+        NSLog("-----MEMORY WARNING-----")
+
+        // Give iOS back some of the guest's memory, rather than waiting to be killed for it.
+        qemu?.relieveMemoryPressure()
+    }
+
     /// Attempts to background the app to Picture in Picture.
     func backgroundToPip() -> Bool {
         /*
@@ -6,7 +6,6 @@
 //  Copyright © 2022 Kate Temkin.
 //
 
-import Atomics
 import Foundation
 import Socket
 
@@ -22,10 +21,166 @@ struct ConfigurationMessage : Codable {
 
     /// The datum associated with the command, if any.
     var value : String?
+
+    /// An identifier the client chose for a request, if any; repeated back in our response to it, so clients that
+    /// pipeline several requests over one connection can match up their responses.
+    var id : String? = nil
+}
+
+
+/// Things that happen on the host, which guest clients can ask to be told about; see our "subscribe" command.
+/// Each is pushed to subscribers as `{"command": "event", "key": <event>, "value": <details, if any>}`.
+enum HostEvent : String, CaseIterable {
+    case appForeground = "app_foreground"
+    case appBackground = "app_background"
+    case snapshotStarted = "snapshot_started"
+    case snapshotFinished = "snapshot_finished"
+    case mountReady = "mount_ready"
+    case terminalResized = "terminal_resized"
+    case cwdChanged = "cwd_changed"
+    case memoryPressure = "memory_pressure"
+    case memoryRecovered = "memory_recovered"
+
+    /// The notification our events travel to the ConfigServer by.
+    static let notification = Notification.Name("com.ktemkin.ios.tctiSH.hostEvent")
+
+    /// Tells any subscribed guest clients that this event has happened.
+    func post(value: String? = nil) {
+        var userInfo : [String: Any] = ["event": self]
+        if let value = value {
+            userInfo["value"] = value
+        }
+        NotificationCenter.default.post(name: HostEvent.notification, object: nil, userInfo: userInfo)
+    }
+}
+
+
+/// Splits the byte stream from a client into newline-delimited messages; however its reads happen to be chunked.
+struct ConfigurationMessageFramer {
+
+    /// A unit of data from the stream: either a complete message, or notice that one was too long to accept.
+    enum Frame {
+        case message(Data)
+        case oversized
+    }
+
+    /// The most we'll buffer for a single message.
+    let maxMessageLength : Int
+
+    /// Bytes we've received that aren't yet part of a complete message.
+    private var buffer = Data()
+
+    /// True while we're skipping the rest of a message that was too long.
+    private var discarding = false
+
+    init(maxMessageLength: Int) {
+        self.maxMessageLength = maxMessageLength
+    }
+
+    /// Adds newly-received data to the stream, and returns any frames it completes.
+    mutating func append(_ data: Data) -> [Frame] {
+        var frames : [Frame] = []
+        buffer.append(data)
+
+        while let newline = buffer.firstIndex(of: UInt8(ascii: "\n")) {
+            let line = buffer[buffer.startIndex..<newline]
+            buffer.removeSubrange(buffer.startIndex...newline)
+
+            if discarding {
+                discarding = false
+            } else if !line.allSatisfy({ $0 == UInt8(ascii: " ") || $0 == UInt8(ascii: "\r") }) {
+                frames.append(.message(Data(line)))
+            }
+        }
+
+        // A message this long without a newline isn't one we'll accept; so skip ahead to the next one.
+        if buffer.count > maxMessageLength {
+            buffer.removeAll()
+            if !discarding {
+                discarding = true
+                frames.append(.oversized)
+            }
+        }
+
+        return frames
+    }
+
+    /// Ends the stream; returning anything left over, for clients that close their connection after their
+    /// last message rather than ending it with a newline.
+    mutating func finish() -> Data? {
+        defer { buffer.removeAll() }
+        return (discarding || buffer.isEmpty) ? nil : buffer
+    }
+}
+
+
+/// Everything we keep track of for a single connected client.
+private final class ConfigServerClient {
+
+    /// The client's socket.
+    let socket : Socket
+
+    /// Splits what the client sends us into messages.
+    /// Only accessed from our server's event queue.
+    var framer : ConfigurationMessageFramer
+
+    /// Tells us when the client has sent us something. Only accessed from our server's event queue.
+    var readSource : DispatchSourceRead?
+
+    /// Work for the client's requests that hasn't started yet, in the order it was sent; whether the work
+    /// needs one of our workers; and whether the client has work running. Only accessed from our server's event queue.
+    var pendingWork : [(usesWorker: Bool, run: () -> Void)] = []
+    var workRunning = false
+
+    /// True once we've stopped reading from the client; it's disconnected once its work is done.
+    /// Only accessed from our server's event queue.
+    var readClosed = false
+
+    /// Runs the client's requests one at a time; so they're handled, and answered, in the order they were sent.
+    let requestQueue : DispatchQueue
+
+    /// Pushes events to the client; separately from its requests, so neither has to wait on the other.
+    let eventQueue : DispatchQueue
+
+    /// True iff this client is a channel shared by everyone in the guest; e.g. our control channel.
+    let shared : Bool
+
+    /// Serializes our writes to the client, and protects the request state below. Our writes time out, so a client
+    /// that stops reading can only hold this for so long.
+    let lock = NSLock()
+
+    /// Counts the requests we've started handling for this client; so a timeout can tell whether the request
+    /// it was set for is still the one in progress.
+    var requestSequence = 0
+
+    /// True while we're handling a request from this client.
+    var requestInProgress = false
+
+    /// The ID the client gave the request we're handling, if any.
+    var currentRequestId : String?
+
+    /// True once the request we're handling has run out of time, and its client has been told so.
+    var currentRequestTimedOut = false
+
+    /// The events the client has subscribed to, if it's subscribed.
+    var subscribedEvents : Set<HostEvent>?
+
+    init(socket: Socket, maxMessageLength: Int, shared: Bool) {
+        self.socket = socket
+        self.shared = shared
+        self.framer = ConfigurationMessageFramer(maxMessageLength: maxMessageLength)
+        self.requestQueue = DispatchQueue(label: "com.ktemkin.ios.tctiSH.configserver.client", qos: .userInitiated)
+        self.eventQueue = DispatchQueue(label: "com.ktemkin.ios.tctiSH.configserver.client.events", qos: .utility)
+    }
 }
 
 
 /// Small server that provides a configuration backend to the tctiSH client.
+///
+/// The server is event-driven: a single serial event queue is woken (via dispatch sources) whenever a socket has
+/// something for us, and never blocks. Requests are handed off to a small, fixed number of workers; each request
+/// gets a limited time to finish before its client is told it timed out. Clients can also subscribe to host events,
+/// which we push to them as they happen.
 class ConfigServer {
     typealias Client = Socket
 
@@ -35,86 +190,191 @@ class ConfigServer {
     /// Maximum length we'll allow in a message payload.
     private static let maxMessageLength = 4096
 
-    /// The sockets on which we'll receive commands from the tctiSH instance.
-    var connectedClients = [Int32: Socket]()
+    /// How often we try to connect to QEMU's end of the guest's control channel, while we're not connected;
+    /// and to bind our port, if we couldn't.
+    private static let retryInterval : TimeInterval = 0.25
+
+    /// How many requests we'll handle at once, across all of our clients.
+    private static let workerCount = 4
+
+    /// How long a request can take before we give up on it, and tell its client so.
+    private static let requestTimeout : TimeInterval = 60
+
+    /// Commands that wait on the user (e.g. on a folder picker); which can take as long as they need.
+    /// They don't take up one of our workers while they wait.
+    private static let interactiveCommands : Set<String> = ["choose_folder", "open_folder"]
+
+    /// How long a write to a client can wait for the client to make room for it, before we give up on the client.
+    private static let sendTimeout : TimeInterval = 5
 
-    /// A queue used to synchronize access to our sockets.
-    let clientLockQueue = DispatchQueue(label: "com.ktemkin.ios.tctiSH.configserver")
+    /// Our connected clients, by socket.
+    /// Only accessed from our client lock queue.
+    private var clients = [Int32: ConfigServerClient]()
+
+    /// A queue used to synchronize access to our clients.
+    private let clientLockQueue = DispatchQueue(label: "com.ktemkin.ios.tctiSH.configserver")
+
+    /// The queue that handles all of our socket events; and owns all of our listening state, below.
+    private let eventQueue = DispatchQueue(label: "com.ktemkin.ios.tctiSH.configserver.events", qos: .userInitiated)
+
+    /// How many more requests we can start handling; each takes a worker while it runs, unless it's waiting on the user.
+    /// Only accessed from our event queue.
+    private var freeWorkers = ConfigServer.workerCount
+
+    /// Clients with requests waiting for a free worker, in the order they started waiting. Requests don't run
+    /// (or take up a thread) until a worker is free. Only accessed from our event queue.
+    private var clientsWaitingForWorker : [ConfigServerClient] = []
+
+    /// Tracks our live dispatch sources; each leaves once its socket is closed. Lets us wait for a stop to finish.
+    private let activeSources = DispatchGroup()
+
+    /// True while we should be listening.
+    /// Only accessed from our event queue.
+    private var running = false
+
+    /// The source that tells us when our listening socket has connections for us to accept.
+    /// Only accessed from our event queue.
+    private var listenerSource : DispatchSourceRead?
+
+    /// Our connection to QEMU's end of the guest's control channel, if we have one.
+    /// Only accessed from our event queue.
+    private var controlChannel : ConfigServerClient?
 
     /// Our interface to our QEMU kernel.
-    /// Should only be accessed from our command loop.
     private var qemu : QEMUInterface
 
-    /// The thread that's running our command-loop.
-    private var thread : Thread?
-
-    /// Flag that's used to indicate when we should stop.
-    private var stopping : ManagedAtomic<Bool>
-    private var stopped : ManagedAtomic<Bool>
+    /// Our registration for host events, which we pass on to our subscribers.
+    private var eventObserver : NSObjectProtocol?
 
     /// Brings up a server and starts it listening.
     init(qemuInterface: QEMUInterface, listenImmediately: Bool = false) {
         self.qemu = qemuInterface
-        self.stopping = ManagedAtomic<Bool>(false)
-        self.stopped  = ManagedAtomic<Bool>(false)
+
+        eventObserver = NotificationCenter.default.addObserver(forName: HostEvent.notification, object: nil, queue: nil) { [weak self] notification in
+            if let event = notification.userInfo?["event"] as? HostEvent {
+                self?.pushEvent(event, value: notification.userInfo?["value"] as? String)
+            }
+        }
 
         if (listenImmediately) {
             listen()
         }
     }
 
-    /// Starts a thread that listens and handles any requests from our client.
+    deinit {
+        if let eventObserver = eventObserver {
+            NotificationCenter.default.removeObserver(eventObserver)
+        }
+    }
+
+    /// Starts listening for, and handling, requests from our clients.
     func listen() {
-        self.stopped.store(false, ordering: .relaxed)
+        eventQueue.async { [unowned self] in
+            guard !self.running else {
+                return
+            }
+            self.running = true
 
-        let queue = DispatchQueue.global(qos: .userInteractive)
-        queue.async { [unowned self] in
+            self.startListening()
 
-            // Wait for a new connection from our guest...
-            let socket = try! Socket.create()
-            try! socket.listen(on: ConfigServer.configurationPort)
+            // Our guest can also reach us over its paravirtual control channel.
+            self.connectControlChannel()
+        }
+    }
 
-            // Ensure that we mark ourselves as stopped once we're done.
-            defer {
-                socket.close()
-                self.stopped.store(true, ordering: .relaxed)
-            }
+    /// Opens our listening socket, and starts accepting connections on it. Must be called from our event queue.
+    private func startListening() {
+        guard running, listenerSource == nil else {
+            return
+        }
 
-            // Try to get a new connection.
-            while !self.stopping.load(ordering: .relaxed) {
-                do {
-                    let newClient = try socket.acceptClientConnection()
-                    self.handleClient(client: newClient)
-                } catch {}
+        // Create a non-blocking listener; so our event queue never waits on it...
+        guard let socket = try? Socket.create() else {
+            NSLog("config server couldn't create its listening socket")
+            return
+        }
+        guard (try? socket.listen(on: ConfigServer.configurationPort)) != nil,
+              (try? socket.setBlocking(mode: false)) != nil else {
+
+            // If our port's still held (e.g. by a listener we've only just stopped), try again shortly.
+            socket.close()
+            eventQueue.asyncAfter(deadline: .now() + ConfigServer.retryInterval) { [weak self] in
+                self?.startListening()
             }
+            return
         }
-    }
 
-    /// Stops execution of the server.
-    public func stop(completion: @escaping () -> ()) {
+        // ... and have it wake us up whenever there's a connection to accept.
+        let source = DispatchSource.makeReadSource(fileDescriptor: socket.socketfd, queue: eventQueue)
+        source.setEventHandler { [unowned self] in
+            guard let client = try? socket.acceptClientConnection() else {
+                return
+            }
 
-        // Mark ourselves as stopping...
-        self.stopping.store(true, ordering: .relaxed)
+            // Our clients inherit our non-blocking mode; but we want their writes to complete in full, or time out.
+            try? client.setBlocking(mode: true)
+            self.addClient(client)
+        }
+        source.setCancelHandler { [activeSources] in
+            socket.close()
+            activeSources.leave()
+        }
 
-        DispatchQueue.main.async {
+        activeSources.enter()
+        listenerSource = source
+        source.resume()
+    }
 
-            // Wait for "stopped" to be set to true, and then call our callback.
-            while true {
-                if self.stopped.load(ordering: .relaxed) {
-                    completion()
-                }
+    /// Keeps us connected to the host end of the guest's control channel: a virtio-serial port that carries the same
+    /// protocol as our TCP port, without the trip through emulated networking. QEMU serves it on a unix socket, which
+    /// goes away whenever QEMU restarts; so whenever we lose our connection, we keep trying until we have one again.
+    /// Everyone in the guest shares the one channel; so it's handled as a single, long-lived client.
+    /// Must be called from our event queue.
+    private func connectControlChannel() {
+        guard running, controlChannel == nil else {
+            return
+        }
+
+        if let path = qemu.controlSocketPath, let channel = try? Socket.create(family: .unix, type: .stream, proto: .unix) {
+            if (try? channel.connect(to: path)) != nil {
+                controlChannel = addClient(channel, shared: true)
+                return
             }
+            channel.close()
+        }
+
+        // If we couldn't connect, try again in a bit. Nothing runs in the meantime.
+        eventQueue.asyncAfter(deadline: .now() + ConfigServer.retryInterval) { [weak self] in
+            self?.connectControlChannel()
         }
     }
 
-    /// Stops execution of the server. Blocking.
+    /// Stops execution of the server; calling `completion` on the main queue once it's stopped.
+    public func stop(completion: @escaping () -> ()) {
+        stop()
+        activeSources.notify(queue: .main, execute: completion)
+    }
+
+    /// Stops execution of the server. If `blocking` is set, waits until all of our sockets are closed;
+    /// which includes waiting for any requests in progress to be answered.
     public func stop(blocking: Bool = false) {
-        // Mark ourselves as stopping...
-        self.stopping.store(true, ordering: .relaxed)
 
-        // ... and wait for the stopping to complete.
+        // Stop listening, and stop reading from each of our clients; each will be disconnected once it's
+        // been answered...
+        eventQueue.sync {
+            self.running = false
+
+            self.listenerSource?.cancel()
+            self.listenerSource = nil
+
+            for client in clientLockQueue.sync(execute: { Array(self.clients.values) }) {
+                client.readSource?.cancel()
+            }
+        }
+
+        // ... and wait for all of that to happen, if we've been asked to.
         if blocking {
-            while !self.stopped.load(ordering: .relaxed) {}
+            activeSources.wait()
         }
     }
 
@@ -125,96 +385,300 @@ class ConfigServer {
     }
 
 
-    /// Handles any communications with a connected client.
-    private func handleClient(client: Socket) {
-        var clientAlive = true
-        var buffer = Data(capacity: ConfigServer.maxMessageLength)
+    /// Starts handling communications with a connected client.
+    /// Clients send newline-delimited messages, and can send as many as they like over a single connection;
+    /// we handle them in order, and respond to each in turn. Must be called from our event queue.
+    @discardableResult
+    private func addClient(_ socket: Socket, shared: Bool = false) -> ConfigServerClient {
+        let client = ConfigServerClient(socket: socket, maxMessageLength: ConfigServer.maxMessageLength, shared: shared)
 
-        // TODO: possibly bump this up from background?
-        let queue = DispatchQueue.global(qos: .background)
+        // Don't let a client that's stopped reading stall our writes to it forever...
+        var timeout = timeval(tv_sec: Int(ConfigServer.sendTimeout), tv_usec: 0)
+        setsockopt(socket.socketfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, socklen_t(MemoryLayout<timeval>.size))
+
+        // ... mark the new socket as connected...
+        clientLockQueue.sync { [unowned self] in
+            self.clients[socket.socketfd] = client
+        }
 
-        // Mark the new socket as connected...
-        clientLockQueue.sync { [unowned self, client] in
-            self.connectedClients[client.socketfd] = client
+        // ... and have our event queue read from it whenever it has something for us.
+        let source = DispatchSource.makeReadSource(fileDescriptor: socket.socketfd, queue: eventQueue)
+        source.setEventHandler { [unowned self] in
+            self.readFromClient(client)
         }
 
-        // ... and handle requests from it.
-        queue.async { [unowned self, client] in
+        // Once we stop reading, let the client's outstanding requests finish and answer before we hang up.
+        source.setCancelHandler { [unowned self] in
+            client.readClosed = true
+            self.disconnectIfIdle(client)
+        }
 
-            // ... and then go into a simple command loop.
-            do {
-                while clientAlive {
+        activeSources.enter()
+        client.readSource = source
+        source.resume()
 
-                    // Get the data that was captured.
-                    let length = try client.read(into: &buffer)
+        return client
+    }
 
-                    // If we didn't get any data, the other side has closed the connection.
-                    // This communication is complete.
-                    if length == 0 {
-                        clientAlive = false
-                    }
-                    // Otherwise, process the client request.
-                    else {
-                        self.handleMessage(rawMessage: buffer, from: client)
-                    }
+    /// Reads whatever a client has sent us, and queues any requests it completes. Must be called from our event queue.
+    private func readFromClient(_ client: ConfigServerClient) {
+        var chunk = [UInt8](repeating: 0, count: ConfigServer.maxMessageLength)
+        let length = read(client.socket.socketfd, &chunk, chunk.count)
+
+        // If we were woken up for nothing, wait for the next event.
+        if length < 0 && (errno == EAGAIN || errno == EINTR) {
+            return
+        }
+
+        // If we didn't get any data, the other side has closed the connection (or broken it);
+        // handle any final request that the client didn't end with a newline, and then stop listening to it.
+        if length <= 0 {
+            if let rawMessage = client.framer.finish() {
+                queueRequest(rawMessage, from: client)
+            }
+            client.readSource?.cancel()
+            return
+        }
+
+        // Otherwise, process any requests the data completes.
+        for frame in client.framer.append(Data(chunk[0..<length])) {
+            switch frame {
+            case .message(let rawMessage):
+                queueRequest(rawMessage, from: client)
+            case .oversized:
+                queueWork(for: client, id: nil, timeout: nil) { [unowned self] in
+                    self.sendErrorResponse("message too long", to: client.socket)
                 }
-            } catch {
-                // On any error, disconnect our socket.
-                clientAlive = false
             }
+        }
+    }
 
-            // Now that we're disconnected, we can erase our knowledge of this client.
-            self.clientLockQueue.sync { [unowned self, client] in
-                self.connectedClients[client.socketfd] = nil
+    /// Queues up a request for handling by one of our workers.
+    private func queueRequest(_ rawMessage: Data, from client: ConfigServerClient) {
+        let message : ConfigurationMessage
+        do {
+            message = try JSONDecoder().decode(ConfigurationMessage.self, from: rawMessage)
+        } catch let err {
+            queueWork(for: client, id: nil, timeout: nil) { [unowned self] in
+                self.sendErrorResponse("error processing command: \(err)", to: client.socket)
             }
+            return
+        }
+
+        let interactive = ConfigServer.interactiveCommands.contains(message.command)
+        queueWork(for: client, id: message.id, timeout: interactive ? nil : ConfigServer.requestTimeout, usesWorker: !interactive) { [unowned self] in
+            self.handleMessage(message, from: client.socket)
         }
     }
 
+    /// Runs a unit of work for a client, once its earlier requests are done and (if it `usesWorker`) a worker is free.
+    /// Everything the work sends is tagged with `id`; and if it runs longer than `timeout`, the client is told so,
+    /// and anything it sends afterwards is dropped. Must be called from our event queue.
+    private func queueWork(for client: ConfigServerClient, id: String?, timeout: TimeInterval?, usesWorker: Bool = true,
+                           work: @escaping () -> Void) {
+        client.pendingWork.append((usesWorker: usesWorker, run: { [unowned self] in
+            self.runWork(for: client, id: id, timeout: timeout, work: work)
+        }))
+        startNextWork(for: client)
+    }
 
-    /// Handles an incoming message from our client.
-    private func handleMessage(rawMessage: Data, from: Client) {
-        let client = from
+    /// Starts the client's next unit of work, if it has one, isn't already running one, and can get a worker for it;
+    /// otherwise, leaves it waiting its turn. Must be called from our event queue.
+    private func startNextWork(for client: ConfigServerClient) {
+        guard !client.workRunning, let next = client.pendingWork.first else {
+            return
+        }
 
-        do {
-            let message = try JSONDecoder().decode(ConfigurationMessage.self, from: rawMessage)
+        if next.usesWorker {
+            guard freeWorkers > 0 else {
+                if !clientsWaitingForWorker.contains(where: { $0 === client }) {
+                    clientsWaitingForWorker.append(client)
+                }
+                return
+            }
+            freeWorkers -= 1
+        }
 
-            switch message.command {
+        client.pendingWork.removeFirst()
+        client.workRunning = true
 
-            // Simple echo command.
-            case "echo":
-                let response = ConfigurationMessage(command: "response", value: message.value)
-                sendMessage(response, to: client)
+        // Once the work's done, hand its worker to whoever's waited longest, and move on to the client's next request.
+        client.requestQueue.async { [unowned self] in
+            next.run()
 
-            // Requests that we pop up a file picker to choose a path.
-            case "choose_folder":
-                handleChoosePath(message: message, from: client)
+            self.eventQueue.async {
+                client.workRunning = false
+                if next.usesWorker {
+                    self.freeWorkers += 1
+                }
 
-            // Requests that we pop up a filer picker to choose a path,
-            // and then ensure that path is accessible to QEMU.
-            case "open_folder":
-                handleOpenPath(message: message, from: client)
+                while self.freeWorkers > 0, !self.clientsWaitingForWorker.isEmpty {
+                    self.startNextWork(for: self.clientsWaitingForWorker.removeFirst())
+                }
+                self.startNextWork(for: client)
+                self.disconnectIfIdle(client)
+            }
+        }
+    }
 
-            // Requests that we prepare a given device for mounting.
-            // Responds with the 'tag' used to mount the device with a `mount -t 9p` command.
-            // {"command": "prepare_mount", "value": "/tmp"}
-            case "prepare_mount":
-                handlePrepareMountCommand(message: message, from: client)
+    /// Hangs up on a client we've stopped reading from, once it has no work left to do. Must be called from our event queue.
+    private func disconnectIfIdle(_ client: ConfigServerClient) {
+        guard client.readClosed, !client.workRunning else {
+            return
+        }
 
-            // Font configuration command.
-            case "font":
-                handleFontConfig(message: message, from: client)
+        // Work that hasn't started yet can still run; its client wants its answers.
+        if !client.pendingWork.isEmpty {
+            return
+        }
 
-            // Handle requests for the CWD.
-            case "getcwd":
-                handleGetCWD(message: message, from: client)
+        client.readClosed = false
+        client.requestQueue.async { [unowned self] in
+            self.disconnectClient(client)
+        }
+    }
 
-            // Respond to all other commands with, basically, "idk".
-            default:
-                sendErrorResponse("command not recognized", to: client)
+    /// Body of a unit of work for a client; run on the client's request queue, once it has a worker.
+    private func runWork(for client: ConfigServerClient, id: String?, timeout: TimeInterval?, work: @escaping () -> Void) {
+        // Mark the request as in progress...
+        client.lock.lock()
+        client.requestSequence += 1
+        client.requestInProgress = true
+        client.currentRequestId = id
+        client.currentRequestTimedOut = false
+        let sequence = client.requestSequence
+        client.lock.unlock()
+
+        // ... start its clock (off our event queue, since timing out means writing to the client) ...
+        if let timeout = timeout {
+            DispatchQueue.global(qos: .utility).asyncAfter(deadline: .now() + timeout) { [weak self] in
+                self?.timeOutRequest(sequence, for: client)
             }
+        }
 
-        } catch let err {
-            sendErrorResponse("error processing command: \(err)", to: client)
+        // ... and handle it.
+        work()
+
+        client.lock.lock()
+        client.requestInProgress = false
+        client.currentRequestId = nil
+        client.lock.unlock()
+    }
+
+    /// Gives up on a client's request, if it's still in progress.
+    private func timeOutRequest(_ sequence: Int, for client: ConfigServerClient) {
+        client.lock.lock()
+        defer { client.lock.unlock() }
+
+        guard client.requestInProgress, client.requestSequence == sequence, !client.currentRequestTimedOut else {
+            return
+        }
+
+        // Answer for the request, so its client isn't left waiting; and drop anything it sends once it does finish.
+        let response = ConfigurationMessage(command: "response", key: "error", value: "request timed out", id: client.currentRequestId)
+        client.currentRequestTimedOut = true
+        writeMessage(response, to: client.socket)
+    }
+
+    /// Forgets about a client, and hangs up on it.
+    private func disconnectClient(_ client: ConfigServerClient) {
+        clientLockQueue.sync { [unowned self] in
+            self.clients[client.socket.socketfd] = nil
+        }
+
+        client.lock.lock()
+        client.subscribedEvents = nil
+        client.socket.close()
+        client.lock.unlock()
+        activeSources.leave()
+
+        // If this was our control channel, QEMU's end has gone away (or we're stopping); reconnect if we should.
+        eventQueue.async { [weak self] in
+            guard let self = self, self.controlChannel === client else {
+                return
+            }
+            self.controlChannel = nil
+            self.connectControlChannel()
+        }
+    }
+
+
+    /// Handles an incoming message from our client.
+    private func handleMessage(_ message: ConfigurationMessage, from: Client) {
+        let client = from
+
+        switch message.command {
+
+        // Simple echo command.
+        case "echo":
+            let response = ConfigurationMessage(command: "response", value: message.value)
+            sendMessage(response, to: client)
+
+        // Requests that we pop up a file picker to choose a path.
+        case "choose_folder":
+            handleChoosePath(message: message, from: client)
+
+        // Requests that we pop up a filer picker to choose a path,
+        // and then ensure that path is accessible to QEMU.
+        case "open_folder":
+            handleOpenPath(message: message, from: client)
+
+        // Requests that we prepare a given device for mounting.
+        // Responds with the 'tag' used to mount the device with a `mount -t 9p` command.
+        // {"command": "prepare_mount", "value": "/tmp"}
+        case "prepare_mount":
+            handlePrepareMountCommand(message: message, from: client)
+
+        // Font configuration command.
+        case "font":
+            handleFontConfig(message: message, from: client)
+
+        // Handle requests for the CWD.
+        case "getcwd":
+            handleGetCWD(message: message, from: client)
+
+        // Sets a storage option (cache mode, AIO mode, qcow2 cache sizes) for the current disk.
+        // Takes effect on the next boot.
+        // {"command": "disk_option", "key": "cache", "value": "none"}
+        case "disk_option":
+            handleDiskOption(message: message, from: client)
+
+        // Reports statistics about QEMU's translated-code cache.
+        case "jit_stats":
+            handleJitStats(message: message, from: client)
+
+        // Lists our saved VM states, with their sizes and save/restore times, as a JSON array.
+        case "snapshot_list":
+            handleSnapshotList(message: message, from: client)
+
+        // Saves the VM's state into a named snapshot; answering once the save is done, or has failed.
+        // {"command": "snapshot_save", "value": "before_upgrade"}
+        case "snapshot_save":
+            handleSnapshotSave(message: message, from: client)
+
+        // Deletes a saved VM state.
+        // {"command": "snapshot_delete", "value": "instant_resume_a"}
+        case "snapshot_delete":
+            handleSnapshotDelete(message: message, from: client)
+
+        // Reports how much storage our saved VM states are taking up, as a JSON object.
+        case "snapshot_stats":
+            handleSnapshotStats(message: message, from: client)
+
+        // Copies everything a thin disk reads from its base image into the disk itself, in the background.
+        // {"command": "disk_flatten"}
+        case "disk_flatten":
+            handleDiskFlatten(message: message, from: client)
+
+        // Keeps the connection open, and pushes host events down it as they happen.
+        // Takes a comma-separated list of events to subscribe to; or subscribes to all of them, if none are given.
+        // {"command": "subscribe", "value": "mount_ready,terminal_resized"}
+        case "subscribe":
+            handleSubscribe(message: message, from: client)
+
+        // Respond to all other commands with, basically, "idk".
+        default:
+            sendErrorResponse("command not recognized", to: client)
         }
     }
 
@@ -285,6 +749,7 @@ class ConfigServer {
 
 
     /// Command that sets up the QEMU side of a host-side mount.
+    /// We only respond once the mount is ready for the guest to use; so the guest never has to wait on it.
     private func handlePrepareMountCommand(message: ConfigurationMessage, from: Client) {
         let client = from
 
@@ -309,16 +774,22 @@ class ConfigServer {
                         tag = mount_result
                     } else {
                         sendErrorResponse("bookmark no longer valid", to: client)
+                        return
                     }
 
                 } else {
                     sendErrorResponse("invalid encoded bookmark", to: client)
+                    return
                 }
 
             }
             // Otherwise, use the host path directly.
             else {
-                tag = qemu.mount(hostPath: hostPath)
+                guard let mount_result = qemu.mount(hostPath: hostPath) else {
+                    sendErrorResponse("could not make \(hostPath) available to the guest", to: client)
+                    return
+                }
+                tag = mount_result
             }
 
             // ... and send the generated tag back to the host.
@@ -366,6 +837,7 @@ class ConfigServer {
         if let term = ViewController.getCurrentTerminal() {
             if let cwd = term.cwd {
                 sendResponse(command: "getcwd", key: "cwd", value: cwd, to: client)
+                return
             }
         }
 
@@ -373,6 +845,165 @@ class ConfigServer {
     }
 
 
+    /// Command that adjusts the storage options for the current disk.
+    private func handleDiskOption(message: ConfigurationMessage, from: Client) {
+        let client = from
+
+        guard let key = message.key, let value = message.value else {
+            sendErrorResponse("disk options require both a key and a value", to: client)
+            return
+        }
+
+        if qemu.setDiskOption(key: key, value: value) {
+            sendAckResponse(command: "disk_option", to: client)
+        } else {
+            sendErrorResponse("\(value) is not a valid value for disk option \(key)", to: client)
+        }
+    }
+
+    /// Command that reports how often QEMU has flushed its translated-code cache.
+    /// Used to measure the effect of the tb-size setting on a given workload.
+    private func handleJitStats(message: ConfigurationMessage, from: Client) {
+        let client = from
+        _ = message
+
+        if let flushes = qemu.getTBFlushCount() {
+            sendResponse(command: "jit_stats", key: "tb_flush_count", value: String(flushes), to: client)
+        } else {
+            sendErrorResponse("could not read translation statistics from QEMU", to: client)
+        }
+    }
+
+
+    /// Command that lists our saved VM states.
+    private func handleSnapshotList(message: ConfigurationMessage, from: Client) {
+        let client = from
+        _ = message
+
+        guard let snapshots = qemu.listSnapshots(),
+              let encoded = try? JSONEncoder().encode(snapshots) else {
+            sendErrorResponse("could not read snapshots from QEMU", to: client)
+            return
+        }
+
+        sendResponse(command: "snapshot_list", key: "snapshots", value: String(data: encoded, encoding: .utf8), to: client)
+    }
+
+    /// Command that saves the VM's state into a named snapshot.
+    private func handleSnapshotSave(message: ConfigurationMessage, from: Client) {
+        let client = from
+
+        guard let name = message.value else {
+            sendErrorResponse("saving a snapshot requires its name", to: client)
+            return
+        }
+
+        if let error = qemu.saveState(tag: name) {
+            sendErrorResponse(error, to: client)
+        } else {
+            sendAckResponse(command: "snapshot_save", to: client)
+        }
+    }
+
+    /// Command that deletes a saved VM state.
+    private func handleSnapshotDelete(message: ConfigurationMessage, from: Client) {
+        let client = from
+
+        guard let name = message.value else {
+            sendErrorResponse("deleting a snapshot requires its name", to: client)
+            return
+        }
+
+        if let error = qemu.deleteSnapshot(name: name) {
+            sendErrorResponse(error, to: client)
+        } else {
+            sendAckResponse(command: "snapshot_delete", to: client)
+        }
+    }
+
+    /// Command that reports how much storage our saved VM states are using.
+    private func handleSnapshotStats(message: ConfigurationMessage, from: Client) {
+        let client = from
+        _ = message
+
+        guard let stats = qemu.getSnapshotStats(),
+              let encoded = try? JSONEncoder().encode(stats) else {
+            sendErrorResponse("could not read snapshots from QEMU", to: client)
+            return
+        }
+
+        sendResponse(command: "snapshot_stats", key: "stats", value: String(data: encoded, encoding: .utf8), to: client)
+    }
+
+    /// Command that starts detaching a thin disk from its base image.
+    private func handleDiskFlatten(message: ConfigurationMessage, from: Client) {
+        let client = from
+        _ = message
+
+        if let error = qemu.flattenDisk() {
+            sendErrorResponse(error, to: client)
+        } else {
+            sendAckResponse(command: "disk_flatten", to: client)
+        }
+    }
+
+
+    /// Command that subscribes a client to host events.
+    private func handleSubscribe(message: ConfigurationMessage, from: Client) {
+        let client = from
+
+        guard let connectedClient = clientLockQueue.sync(execute: { clients[client.socketfd] }) else {
+            return
+        }
+
+        // Everyone in the guest shares our control channel; and events left unread there would back it up for all of them.
+        guard !connectedClient.shared else {
+            sendErrorResponse("subscriptions need a connection of their own", to: client)
+            return
+        }
+
+        // Figure out which events we're subscribing to...
+        var events = Set(HostEvent.allCases)
+        if let names = message.value, !names.isEmpty {
+            events = []
+            for name in names.split(separator: ",") {
+                guard let event = HostEvent(rawValue: name.trimmingCharacters(in: .whitespaces)) else {
+                    sendErrorResponse("\(name) is not an event we know about", to: client)
+                    return
+                }
+                events.insert(event)
+            }
+        }
+
+        // ... and start pushing them, once the client knows its subscription is in place.
+        sendAckResponse(command: "subscribe", to: client)
+
+        connectedClient.lock.lock()
+        connectedClient.subscribedEvents = events
+        connectedClient.lock.unlock()
+    }
+
+
+    /// Pushes an event to every client that's subscribed to it.
+    private func pushEvent(_ event: HostEvent, value: String?) {
+        let message = ConfigurationMessage(command: "event", key: event.rawValue, value: value)
+
+        for client in clientLockQueue.sync(execute: { Array(clients.values) }) {
+            client.eventQueue.async { [weak self] in
+                client.lock.lock()
+                defer { client.lock.unlock() }
+
+                // Events aren't responses; so they're sent as-is, rather than through sendMessage().
+                // A subscriber that can't keep up is hung up on, rather than left to hold up its own requests.
+                if client.subscribedEvents?.contains(event) == true, self?.writeMessage(message, to: client.socket) == false {
+                    client.subscribedEvents = nil
+                    self?.hangUp(client)
+                }
+            }
+        }
+    }
+
+
     /// Indicates something was wrong with a received command.
     private func sendErrorResponse(_ message: String, to: Client) {
         sendMessage(ConfigurationMessage(command: "response", key: "error", value: message), to: to)
@@ -394,14 +1025,65 @@ class ConfigServer {
     }
 
     /// Sends a simple message across our communications channel.
+    /// Messages sent while handling a request are tagged with its ID; and dropped, if that request has timed out.
     private func sendMessage(_ message: ConfigurationMessage, to: Client) {
-        do {
-            let rawMessage = try JSONEncoder().encode(message)
-            try to.write(from: rawMessage)
-            try to.write(from: "\n")
-        } catch {
+        guard let client = clientLockQueue.sync(execute: { clients[to.socketfd] }) else {
+            writeMessage(message, to: to)
+            return
+        }
+
+        client.lock.lock()
+        defer { client.lock.unlock() }
+
+        if client.requestInProgress && client.currentRequestTimedOut {
+            return
+        }
+
+        var message = message
+        if message.id == nil {
+            message.id = client.currentRequestId
+        }
+        if !writeMessage(message, to: to) {
+            hangUp(client)
+        }
+    }
+
+    /// Writes a message to a client's socket, as a single line. Callers serialize writes to each client.
+    /// Returns false if the message couldn't be written in full; e.g. because the client stopped reading,
+    /// and the write timed out. Anything we write to that client afterwards would arrive garbled.
+    @discardableResult
+    private func writeMessage(_ message: ConfigurationMessage, to: Client) -> Bool {
+        guard let rawMessage = try? JSONEncoder().encode(message) else {
+            NSLog("failed to encode message!")
+            return false
+        }
+
+        let written = (rawMessage + "\n".data(using: .utf8)!).withUnsafeBytes { (buffer: UnsafeRawBufferPointer) -> Bool in
+            var offset = 0
+            while offset < buffer.count {
+                let sent = send(to.socketfd, buffer.baseAddress! + offset, buffer.count - offset, 0)
+                if sent < 0 && errno == EINTR {
+                    continue
+                }
+                if sent <= 0 {
+                    return false
+                }
+                offset += sent
+            }
+            return true
+        }
+
+        if !written {
             NSLog("failed to send message!")
         }
+        return written
+    }
+
+    /// Stops reading from a client we can no longer write to; it's disconnected once its requests are done.
+    private func hangUp(_ client: ConfigServerClient) {
+        eventQueue.async {
+            client.readSource?.cancel()
+        }
     }
 
 }
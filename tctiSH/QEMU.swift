@@ -6,7 +6,6 @@
 //  Copyright ©2022 Kate Temkin. All rights reserved.
 //
 
-import Socket
 import Foundation
 
 /// Structure that stores the metadata associated with a given mount.
@@ -23,6 +22,80 @@ struct DiskMountInfo : Codable {
 }
 
 
+/// Structure that stores what we've learned about a saved VM state, beyond what QEMU records itself.
+struct SnapshotRecord : Codable {
+
+    /// How long the state took to save, and to restore, in milliseconds; if we've timed it.
+    var save_ms : Double?
+    var load_ms : Double?
+
+    /// False if we started saving this state, but never saw the save finish.
+    var complete : Bool = true
+
+    /// How much RAM the guest was using before and after we trimmed it for this save, in bytes; if we did.
+    var ram_before_trim : UInt64?
+    var ram_after_trim : UInt64?
+}
+
+
+/// Structure that describes a saved VM state, as listed in our snapshot catalog.
+struct SnapshotInfo : Codable {
+
+    /// The name of the snapshot; our state-file save is listed as "@state_file".
+    var name : String
+
+    /// How many bytes of VM state (RAM and device state) the snapshot holds.
+    var vm_state_size : UInt64
+
+    /// When the snapshot was taken, in seconds since the epoch; or zero if we don't know.
+    var date : UInt64
+
+    /// How long the snapshot took to save, and to restore, in milliseconds; if we've timed it.
+    var save_ms : Double?
+    var load_ms : Double?
+
+    /// False if the snapshot can't be resumed from: its save never finished, or the guest has since moved on.
+    var complete : Bool
+
+    /// How much RAM the guest was using before and after we trimmed it for the save, in bytes; if we did.
+    var ram_before_trim : UInt64?
+    var ram_after_trim : UInt64?
+
+    /// True iff this is the snapshot our next persistent boot will resume from.
+    var resume_image : Bool
+}
+
+
+/// Structure that summarizes how much storage our saved VM states are taking up.
+struct SnapshotStats : Codable {
+
+    /// The number of saved states we have, and the VM state they hold between them, in bytes.
+    var snapshot_count : Int
+    var vm_state_bytes : UInt64
+
+    /// Storage actually used by our disk image (which includes its qcow snapshots), and by our state files.
+    var disk_file_bytes : UInt64
+    var state_file_bytes : UInt64
+    var memory_file_bytes : UInt64
+
+    /// How many saves we've made in our current snapshot mode with the guest's RAM trimmed first, and without;
+    /// and the average size of the state each wrote, in bytes. Lets us see what trimming actually saves.
+    var trimmed_save_count : Int
+    var trimmed_save_bytes : UInt64?
+    var untrimmed_save_count : Int
+    var untrimmed_save_bytes : UInt64?
+}
+
+
+/// Running totals of the state we've written in our saves; split by whether we trimmed the guest's RAM first.
+struct SaveSizeTotals : Codable {
+    var trimmed_saves : Int = 0
+    var trimmed_bytes : UInt64 = 0
+    var untrimmed_saves : Int = 0
+    var untrimmed_bytes : UInt64 = 0
+}
+
+
 /// Provides an interface for running / controlling a QEMU VM.
 public class QEMUInterface {
 
@@ -32,30 +105,192 @@ public class QEMUInterface {
     /// The port on which we connect using the QEMU monitor.
     private static let monitorPort : Int32 = 10044
 
-    /// Our QEMU human-readable protocol socket.
-    var monitorSocket : Socket?
+    /// Per-disk storage options we allow, and the values each may take. Values of `nil` accept any
+    /// value that passes the associated format check.
+    static let diskOptionValues : [String: [String]?] = [
+        "cache": ["writeback", "writethrough", "none", "unsafe"],
+        "aio": ["threads", "io_uring"],
+        "l2-cache-size": nil,
+        "cache-clean-interval": nil,
+    ]
+
+    /// The most L2 table cache we'll give a qcow by default; enough to map 256GiB of 64KiB clusters.
+    private static let maximumDefaultL2CacheSize : UInt64 = 32 << 20
+
+    /// How often, in seconds, qcow2 should drop L2 cache entries that haven't been used.
+    private static let defaultCacheCleanInterval : String = "300"
+
+    /// Bounds for our automatically-chosen translation buffer size, in MiB.
+    private static let minimumTbSize : UInt64 = 64
+    private static let maximumTbSize : UInt64 = 512
+
+    /// The resume image that tells us to resume from our state file, rather than from a qcow snapshot.
+    private static let stateFileResumeTag : String = "@state_file"
+
+    /// The longest we'll wait for a state save to complete. Background saves also never wait past the time iOS
+    /// has given us; see performBackgroundSave().
+    private static let stateSaveTimeout : TimeInterval = 20
+
+    /// The longest we'll wait for QEMU to finish a savevm.
+    private static let savevmTimeout : TimeInterval = 30
+
+    /// The migration capabilities our state files are saved with in each snapshot mode; along with the
+    /// `-global migration.<property>` that sets each when loading.
+    private static let stateFileCapabilities : [String: [(capability: String, property: String)]] = [
+        "state_file": [("x-ignore-shared", "x-ignore-shared")],
+        "compressed_state": [("compress", "x-compress")],
+        "overlay_state": [("compress", "x-compress")],
+    ]
+
+    /// The QEMU drive that holds our disk, and thus our qcow snapshots.
+    private static let diskDriveId : String = "drive1"
+
+    /// The prefix of the snapshots we alternate between for instant resume.
+    private static let instantResumePrefix : String = "instant_resume_"
+
+    /// Snapshots we never delete: the clean-boot snapshot that ships with our disk image.
+    private static let protectedSnapshots : Set<String> = ["instantboot"]
+
+    /// The ID of the QEMU block job we use to merge disk layers.
+    private static let diskMergeJobId : String = "tctish-merge"
+
+    /// How fast our disk-layer merges may go, in bytes per second; so they trickle along behind the guest,
+    /// rather than competing with its own I/O.
+    private static let diskMergeSpeed : Int = 32 << 20
+
+    /// How long after boot we wait to start merging disk layers; so the merge runs behind an idle guest,
+    /// rather than slowing down its startup.
+    private static let diskMergeDelay : TimeInterval = 30
+
+    /// How long we'll wait for a merge to stop, once we've cancelled it.
+    private static let diskMergeCancelTimeout : TimeInterval = 5
+
+    /// Revision of the virtual hardware we give the guest. Saved states only load onto the hardware they were saved
+    /// from; so bump this whenever we add or remove a device, and the next boot will start afresh. Our instant-boot
+    /// snapshot was saved from this revision; so any bump also needs a new one shipped in our base image.
+    /// Devices that only some boots have (e.g. our control channel) are tracked per boot instead.
+    private static let machineRevision : Int = 0
+
+    /// The number of vCPUs our base image's instant-boot snapshot was saved with; it only loads onto the same.
+    private static let instantBootCpuCount : Int = 4
+
+    /// The ID of the QEMU block job we use to flatten thin disks.
+    private static let diskFlattenJobId : String = "tctish-flatten"
+
+    /// The bundled image that new disks start out as.
+    private static let baseImageName : String = "empty.qcow"
+
+    /// The cluster size we give the thin disks we create, as a power of two; 64KiB, as qemu-img would.
+    private static let thinDiskClusterBits : Int = 16
+
+    /// How long we'll wait for QEMU to load our state, when resuming from an overlay save.
+    private static let overlayResumeTimeout : TimeInterval = 60
+
+    /// The least memory we'll ever shrink the guest to, in bytes; below this, it'd struggle to run at all.
+    private static let minimumGuestMemory : UInt64 = 256 << 20
+
+    /// How long we'll wait for the guest to start running, before giving it the memory it's been asked to use.
+    private static let guestStartTimeout : TimeInterval = 120
+
+    /// How often we check QEMU's run state while waiting on it, if it hasn't told us it's changed.
+    private static let runStateRecheckInterval : TimeInterval = 1
+
+    /// Where our balloon device lives in QEMU's object tree.
+    private static let balloonPath : String = "/machine/peripheral/balloon0"
+
+    /// How often the guest updates the memory statistics its balloon reports, in seconds.
+    private static let balloonStatsInterval : Int = 2
+
+    /// How much of the memory the guest reports as free or cache we leave it, when trimming it before a save;
+    /// so it isn't left with nothing to work in once it runs again.
+    private static let memoryTrimHeadroom : UInt64 = 64 << 20
+
+    /// The longest we'll spend squeezing the guest's RAM before a save; and how long it has to stop shrinking,
+    /// before we decide it's given up all it's going to. QEMU reports balloon changes at most once a second,
+    /// so we have to give it a little longer than that.
+    private static let memoryTrimTimeout : TimeInterval = 3
+    private static let memoryTrimSettleTime : TimeInterval = 1.2
+
+    /// How long after iOS last warned us about memory we'll wait, before giving the guest its memory back.
+    private static let memoryPressureRecoveryDelay : TimeInterval = 60
+
+    /// How hard to compress RAM in compressed state saves. Level 1 gets most of zlib's size savings,
+    /// at a fraction of the time of its higher levels.
+    private static let stateCompressionLevel : Int = 1
+
+    /// How the running VM saves its state; see getSnapshotMode().
+    /// This is fixed at launch; changes to the setting take effect on the next boot.
+    var activeSnapshotMode = "savevm"
+
+    /// True iff a state save has left our VM paused, waiting for us to come back to the foreground.
+    var pausedForStateSave = false
+
+    /// When the background save in progress has to be done by, if one is in progress; and the lock that protects it,
+    /// since it can be cut short from the main thread.
+    private var saveDeadline = Date.distantFuture
+    private let saveDeadlineLock = NSLock()
+
+    /// Our connection to QEMU's machine protocol (QMP), and the socket it runs over.
+    var qmp : QMPClient?
     var monitorSocketPath : String?
 
-    /// A queue used for general monitor operations.
-    let monitorQueue = DispatchQueue(label: "com.ktemkin.ios.tctiSH.monitor")
+    /// The unix socket QEMU serves the host end of our guest control channel on; see ConfigServer.
+    var controlSocketPath : String?
+
+    /// The saved state our running VM was restored from, until we've recorded how long that restore took.
+    private var pendingRestoreTiming : String?
+
+    /// Keeps snapshot deletions from running alongside our saves; so we never delete a snapshot as it's being written.
+    private let snapshotLock = NSRecursiveLock()
+
+    /// True while QEMU is merging our disk layers; and our subscriptions to hear about how that goes.
+    /// Each merge gets a new generation, so we never mistake news about an old merge for the current one.
+    private var diskMergeRunning = false
+    private var diskMergeGeneration = 0
+    private var diskMergeSubscriptions : [(event: String, token: UUID)] = []
+
+    /// Runs our changes to the guest's memory, one at a time.
+    private let memoryQueue = DispatchQueue(label: "tctiSH guest memory", qos: .utility)
+
+    /// While iOS is short on memory, the memory we've shrunk the guest to, in bytes. Each warning gets a new
+    /// generation, so only the latest one's timer gives the guest its memory back. Only touched on our memory queue.
+    private var memoryPressureTarget : UInt64?
+    private var memoryPressureGeneration = 0
+
+    /// Starts loading our QEMU framework in the background, while we do the rest of our startup.
+    /// A subsequent startQemuThread() picks up the loaded framework, rather than loading it itself.
+    func prewarmFramework() {
+        qemu_launcher_prewarm(getAppropriateQemuFramework().path, getSharedFolder().path)
+    }
+
 
     /// Start our background QEMU thread.
     func startQemuThread(forceRecoveryBoot: Bool = false) {
 
         // Clear any state left over from previous runs.
         clearLastCWDFile()
+        pausedForStateSave = false
         
         // Figure out where our QEMU resources are...
         let bundlePrefix = Bundle.main.resourcePath!
         let kernelPath = bundlePrefix + "/" + "bzImage"
         let initrdPath = bundlePrefix + "/" + "initrd.img"
         
-        // ... get a disk to run with ...
-        let diskPath = getPersistentStore().path
-        NSLog("Disk path: \(diskPath)")
+        // ... make sure we have a disk to run with, and that it can find its base image ...
+        _ = getPersistentStore()
+        if let baseImage = getThinDiskBase() {
+            QEMUInterface.updateBackingFile(diskURL: getPersistentStore(), baseURL: baseImage)
+        }
         
         // ... figure out which image we'll be restoring state from ...
         let bootImageName = getBootImageName(forceRecoveryBoot: forceRecoveryBoot)
+        let resumeFromStateFile = (bootImageName == QEMUInterface.stateFileResumeTag)
+        pendingRestoreTiming = bootImageName
+        activeSnapshotMode = getSnapshotMode()
+
+        // ... and figure out which of its layers the guest will be running on ...
+        let diskPath = configureDiskLayers(bootImageName: bootImageName, resume: resumeFromStateFile).path
+        NSLog("Disk path: \(diskPath)")
 
         // ... find where our QEMU binary is actually located ...
         let qemuImage = getAppropriateQemuFramework().path
@@ -63,82 +298,1222 @@ public class QEMUInterface {
         // ... figure out the folder we'll be sharing into our environment ...
         let sharedFolder = getSharedFolder().path
 
-        // ... figure out how much memory to give the VM ...
-        let memoryValue = getMemoryValue()
+        // ... figure out how much memory to give the VM; our instant-boot snapshot only loads onto the hardware
+        // it was saved from, so restoring it pins that, whatever our settings ask for ...
+        let instantBoot = (bootImageName == "instantboot")
+        let memoryValue = getBootMemoryValue(coldBoot: bootImageName == nil)
+        let useBalloon = !instantBoot && balloonRequested()
+
+        // ... figure out how many cores to give it, and how to run them ...
+        let cpuCount = instantBoot ? QEMUInterface.instantBootCpuCount : getCpuCount()
+        let multithreadedTcg = getTcgThreadMode() == "multi"
+
+        // ... get a filename for our unix domain QMP socket ...
+        monitorSocketPath = getDatastoreURL("monitor", fileExtension: "socket").path
+        if qmp == nil {
+            qmp = QMPClient(socketPath: monitorSocketPath!)
+        }
+
+        // ... and another for the guest's control channel ...
+        controlSocketPath = getDatastoreURL("control", fileExtension: "socket").path
+        
+        // ... build the command line we'll be launching with ...
+        let config = qemu_launch_config_create_default(qemuImage, kernelPath, initrdPath, bundlePrefix, diskPath, sharedFolder,
+                                                       resumeFromStateFile ? nil : bootImageName, memoryValue, monitorSocketPath,
+                                                       Int32(cpuCount), multithreadedTcg, AppDelegate.usingJitHacks)
+        _ = qemu_launch_config_set_property(config, "-accel", nil, "tb-size", String(getTbSize()))
+        qemu_launch_config_set_disk_io(config, UserDefaults.standard.bool(forKey: "disk_iothread"), Int32(cpuCount))
+        if useBalloon {
+            qemu_launch_config_add_balloon(config)
+        }
+        let useControlChannel = controlChannelRequested(bootImageName: bootImageName)
+        if useControlChannel {
+            qemu_launch_config_add_control_channel(config, controlSocketPath)
+        }
+        for (key, value) in getDiskOptions(diskURL: URL(fileURLWithPath: diskPath)) {
+            _ = qemu_launch_config_set_property(config, "-drive", "drive1", key, value)
+        }
+        // ... keep guest RAM somewhere our state saves can make use of it ...
+        if activeSnapshotMode != "savevm" {
+            configureStateFiles(config: config, memoryValue: memoryValue, resume: resumeFromStateFile)
+        } else {
+            removeStateFiles()
+        }
+        applyUserLaunchOptions(config: config)
+
+        // ... and start up the QEMU kernel, which will start paused.
+        if !run_background_qemu_with_config(config) {
+            NSLog("could not launch QEMU; we may be out of memory")
+            return
+        }
+
+        // Mark the amount of memory and cores we booted with, for next time.
+        setLastMemoryValue(value: memoryValue)
+        UserDefaults.standard.set(useBalloon, forKey: "last_memory_balloon")
+        UserDefaults.standard.set(useControlChannel, forKey: "last_control_channel")
+        setLastCpuCount(value: cpuCount)
+        UserDefaults.standard.set(QEMUInterface.machineRevision, forKey: "last_machine_revision")
+
+        // Once the guest is running, shrink it to the memory it's been asked to use; if that's less than it booted with.
+        memoryQueue.async { [weak self] in
+            guard let self = self else {
+                return
+            }
+
+            if self.waitForRunState(timeout: QEMUInterface.guestStartTimeout, until: { $0 == "running" }) == nil {
+                NSLog("guest didn't start running; leaving its memory as it booted")
+                return
+            }
+            self.enableBalloonStats()
+            self.applyGuestMemoryTarget()
+        }
+
+        // Recreate our persistent mounts, so they're available in the VM...
+        recreatePersistentMounts()
+
+        // ... and finally, once the guest has its state back, sort out our disk layers.
+        if resumeFromStateFile && (activeSnapshotMode == "overlay_state") {
+            finishOverlayResume()
+        } else {
+            DispatchQueue.global(qos: .utility).asyncAfter(deadline: .now() + QEMUInterface.diskMergeDelay) { [weak self] in
+                self?.mergeDiskLayers()
+            }
+        }
+    }
+    
+    /// Shuts down our running QEMU, and waits for it to exit; so it shouldn't be called from the main thread.
+    /// Only used as we're terminating: QEMU can only run once per process, so it can't be started again afterwards.
+    /// Returns true iff QEMU was running and shut down cleanly.
+    func stopQemuThread() -> Bool {
+        disconnectMonitor()
+        return qemu_launcher_stop() == 0
+    }
+
+    /// Returns how long each phase of startup took, in milliseconds since launch.
+    /// Phases that haven't happened yet are omitted.
+    func getLaunchTimings() -> [String: Double] {
+        let phases : [(String, launch_phase)] = [
+            ("dlopen", LAUNCH_PHASE_DLOPEN),
+            ("symbols", LAUNCH_PHASE_SYMBOLS),
+            ("qemu_start", LAUNCH_PHASE_QEMU_START),
+            ("qemu_init", LAUNCH_PHASE_INIT),
+            ("first_vcpu_run", LAUNCH_PHASE_FIRST_VCPU_RUN),
+            ("first_connection", LAUNCH_PHASE_FIRST_CONNECTION),
+            ("memory_prefetched", LAUNCH_PHASE_MEMORY_PREFETCHED),
+        ]
+
+        var timings : [String: Double] = [:]
+        for (name, phase) in phases {
+            let elapsed = launch_trace_elapsed_ms(phase)
+            if elapsed >= 0 {
+                timings[name] = elapsed
+            }
+        }
+
+        return timings
+    }
+
+    /// Applies any extra QEMU options and accelerator properties the user has specified in Settings.
+    /// These allow experimenting with tuning flags without a rebuild.
+    private func applyUserLaunchOptions(config: OpaquePointer?) {
+        let extraOptions = UserDefaults.standard.string(forKey: "extra_qemu_options") ?? ""
+        let accelProperties = UserDefaults.standard.string(forKey: "accel_properties") ?? ""
+
+        // Extra options are given as they would be on a command line; e.g. `-object iothread,id=io0`.
+        let tokens = extraOptions.split(whereSeparator: { $0.isWhitespace }).map(String.init)
+        var index = 0
+        while index < tokens.count {
+            let option = tokens[index]
+            index += 1
+
+            guard option.hasPrefix("-") else {
+                NSLog("ignoring stray QEMU argument \(option)")
+                continue
+            }
+
+            // Options that aren't followed by a value are flags.
+            if index < tokens.count && !tokens[index].hasPrefix("-") {
+                qemu_launch_config_add_option(config, option, tokens[index])
+                index += 1
+            } else {
+                qemu_launch_config_add_option(config, option, nil)
+            }
+        }
+
+        // Accelerator properties are given as a property list; e.g. `tb-size=256,one-insn-per-tb=off`.
+        for property in accelProperties.split(separator: ",") {
+            let parts = property.split(separator: "=", maxSplits: 1).map(String.init)
+            guard parts.count == 2 else {
+                NSLog("ignoring malformed accelerator property \(property)")
+                continue
+            }
+
+            _ = qemu_launch_config_set_property(config, "-accel", nil, parts[0], parts[1])
+        }
+    }
+
+    /// Saves the state of the running QEMU instance into a named qcow snapshot, and waits for the save to finish;
+    /// so it shouldn't be called from the main thread. Returns nil on success, or a description of why we couldn't save.
+    func saveState(tag: String) -> String? {
+        snapshotLock.lock()
+        defer { snapshotLock.unlock() }
+
+        guard !tag.isEmpty, !tag.hasPrefix("@"), !tag.contains(where: { $0.isWhitespace }) else {
+            return "\(tag) isn't a valid snapshot name"
+        }
+        guard !QEMUInterface.protectedSnapshots.contains(tag) else {
+            return "\(tag) is needed for clean boots, and can't be replaced"
+        }
+
+        // A qcow snapshot would only capture our top layer, and be lost when it's merged; so our layers need merging first.
+        cancelDiskMerge()
+        guard getDiskLayers().isEmpty else {
+            mergeDiskLayers()
+            return "can't take a snapshot until our disk layers have been merged; try again shortly"
+        }
+
+        return saveStateAndWait(tag: tag)
+    }
+
+    /// Saves the state of the running QEMU instance into a qcow snapshot, and waits for the save to finish.
+    /// Returns nil if QEMU reports the save succeeded, or a description of why it didn't.
+    private func saveStateAndWait(tag: String) -> String? {
+
+        // Snapshots need to include RAM as-is; so make sure we're not still set up for state files,
+        // as we are after resuming from one.
+        setStateFileCapabilities(nil, wait: true)
+        updateSnapshotRecord(tag) { $0 = SnapshotRecord(complete: false) }
+
+        // QEMU doesn't answer until savevm is done; and then tells us about any errors in its output.
+        let started = Date()
+        let timeout = remainingSaveTime(upTo: QEMUInterface.savevmTimeout)
+        guard let output = qmp?.humanMonitorCommand("savevm \(tag)", timeout: timeout) else {
+            return "QEMU didn't finish saving \(tag)"
+        }
+        if output.contains("Error") {
+            return "QEMU could not save \(tag): \(output.trimmingCharacters(in: .whitespacesAndNewlines))"
+        }
+
+        recordCompletedSave(tag, started: started)
+        return nil
+    }
+
+    /// Saves the VM's state into our state file. In "state_file" mode, this is just device state, as its RAM
+    /// already lives in our memory file; in our other modes, RAM is compressed into the state file.
+    /// QEMU leaves the VM paused afterwards, so the guest keeps matching the saved state until we resume it.
+    /// Returns true once the state, and any RAM it goes with, are safely in storage.
+    private func saveStateToFile() -> Bool {
+        let socketPath = getMigrationSocketPath()
+        let overlay = (activeSnapshotMode == "overlay_state")
+
+        // Our current state file stops matching the guest as soon as the guest runs; which it has been.
+        // In overlay mode, it still matches the disk layer we froze for it; so it's good until we replace it.
+        if !overlay {
+            setStateFileValid(false)
+        }
+        updateSnapshotRecord(QEMUInterface.stateFileResumeTag) { $0 = SnapshotRecord(complete: false) }
+        let started = Date()
+
+        // In overlay mode, freeze the disk at the same instant as the rest of our state: we pause the guest,
+        // and have it write into a new layer once it runs again.
+        let frozenLayer = getDiskLayers().last
+        if overlay {
+            qmp?.executeAndWait("stop", timeout: remainingSaveTime(upTo: QEMUInterface.stateSaveTimeout))
+            pausedForStateSave = true
+
+            guard addDiskLayer() != nil else {
+                NSLog("failed to freeze VM disk for state save")
+                return false
+            }
+        }
+
+        // Have QEMU send us its state, in the form our mode calls for...
+        guard qemu_state_sink_start(socketPath, getStateFileURL().path) else {
+            return false
+        }
+        setStateFileCapabilities(activeSnapshotMode)
+        if activeSnapshotMode != "state_file" {
+            qmp?.execute("migrate-set-parameters", arguments: [
+                "compress-threads": QEMUInterface.getSnapshotThreadCount(),
+                "compress-level": QEMUInterface.stateCompressionLevel,
+            ])
+        }
+
+        // ... wait for QEMU to tell us it's done ...
+        let completed = migrate(to: "unix:\(socketPath)")
+        setStateFileCapabilities(nil)
+        if completed {
+            pausedForStateSave = true
+        }
+        if overlay && completed {
+            setStateFileValid(false)
+        }
+
+        // ... and write out the new state, along with any RAM pages the guest has dirtied since our last save.
+        guard qemu_state_sink_finish(completed) else {
+            NSLog("failed to save VM state to file")
+            return false
+        }
+        if (activeSnapshotMode == "state_file") && !qemu_sync_file(getMemoryFileURL().path) {
+            NSLog("failed to write VM memory file")
+            return false
+        }
+        if overlay {
+            setResumeLayer(frozenLayer)
+        }
+
+        setImageProperty(diskName: getDiskName(), property: "state_file_mode", value: activeSnapshotMode)
+        setStateFileValid(true)
+        recordCompletedSave(QEMUInterface.stateFileResumeTag, started: started)
+        return true
+    }
+
+    /// Turns on the migration capabilities used for state files in the given snapshot mode, and turns off
+    /// the rest; or, with a nil mode, turns them all off. Also turns on migration events, so we hear
+    /// about our saves' progress. Commands are pipelined, unless we're asked to wait for them.
+    private func setStateFileCapabilities(_ mode: String?, wait: Bool = false) {
+        let enabled = QEMUInterface.stateFileCapabilities[mode ?? ""] ?? []
+
+        var capabilities : [[String: Any]] = [["capability": "events", "state": true]]
+        for capability in QEMUInterface.stateFileCapabilities.values.joined() {
+            let state = enabled.contains { $0.capability == capability.capability }
+            capabilities.append(["capability": capability.capability, "state": state])
+        }
+
+        if wait {
+            qmp?.executeAndWait("migrate-set-capabilities", arguments: ["capabilities": capabilities])
+        } else {
+            qmp?.execute("migrate-set-capabilities", arguments: ["capabilities": capabilities])
+        }
+    }
+
+    /// Starts an outgoing migration to the given URI, and waits for QEMU to tell us it's finished.
+    /// Returns true iff it completed.
+    private func migrate(to uri: String) -> Bool {
+        guard let qmp = qmp else {
+            return false
+        }
+
+        let finished = DispatchSemaphore(value: 0)
+        var status = ""
+
+        // QEMU tells us about each step of the migration; we only care about how it ends.
+        let subscription = qmp.subscribe(to: "MIGRATION") { _, data in
+            let newStatus = data["status"] as? String ?? ""
+            if ["completed", "failed", "cancelled"].contains(newStatus) {
+                status = newStatus
+                finished.signal()
+            }
+        }
+        defer {
+            qmp.unsubscribe(from: "MIGRATION", token: subscription)
+        }
+
+        guard case .success = qmp.executeAndWait("migrate", arguments: ["uri": uri]) else {
+            return false
+        }
+
+        // If we run out of time, don't leave QEMU stuck partway through a save. We've no time left to wait for it
+        // to stop, either; the partial stream is thrown away regardless.
+        if finished.wait(timeout: .now() + remainingSaveTime(upTo: QEMUInterface.stateSaveTimeout)) == .timedOut {
+            qmp.execute("migrate_cancel")
+            return false
+        }
+
+        return status == "completed"
+    }
+
+    /// Lets our VM run again, if a state save left it paused. Once it does, its RAM and disk no longer match
+    /// our state file; so we can't resume from that file again until the next save. The exception is overlay mode,
+    /// where our saved disk has been frozen in its own layer.
+    func resumeAfterBackgroundSave() {
+        if !pausedForStateSave {
+            return
+        }
+
+        if activeSnapshotMode != "overlay_state" {
+            setStateFileValid(false)
+        }
+        pausedForStateSave = false
+        resume()
+    }
+    
+    /// Saves the state of the running QEMU instance.
+    /// With no arguments, loads from the Instant Boot cache.
+    func loadState(tag: String) {
+        qmp?.execute("human-monitor-command", arguments: ["command-line": "loadvm \(tag)"])
+        qmp?.execute("cont")
+    }
+
+    /// Saves the state of the running QEMU instance in a background-safe manner.
+    /// Blocks until the save is done; so it should be run off the main thread. Nothing in the save waits past
+    /// `deadline`, which should leave time to spare before iOS's background time runs out; and cancelBackgroundSave()
+    /// can cut it short. Callers should only save once we've connected to our VM.
+    func performBackgroundSave(deadline: Date = .distantFuture) {
+        // There's nothing new to save if we haven't run since our last save.
+        if pausedForStateSave {
+            return;
+        }
+
+        setSaveDeadline(deadline)
+        defer { setSaveDeadline(.distantFuture) }
+
+        // Note how long our last restore took, while we still have the launch trace that tells us.
+        recordRestoreTiming()
+
+        snapshotLock.lock()
+        defer { snapshotLock.unlock() }
+        let nextTag = getNextInstantResumeTag()
+
+        // Our saves need the disk to hold still; any merge can carry on once we're back.
+        cancelDiskMerge()
+
+        // A qcow snapshot would only capture our top layer, and be lost when it's merged; so wait for the merge.
+        if (activeSnapshotMode == "savevm") && !getDiskLayers().isEmpty {
+            NSLog("not saving state until our disk layers have been merged")
+            return
+        }
+
+        // Let the guest know a save is underway; it'll hear once it's done, whether or not it worked.
+        HostEvent.snapshotStarted.post(value: activeSnapshotMode)
+        var savedTag : String? = nil
+        defer { HostEvent.snapshotFinished.post(value: savedTag ?? "failed") }
+
+        // Squeeze down the RAM we're about to save, if we can; and give it back once we're done.
+        let trim = trimGuestMemory()
+        defer {
+            if trim != nil {
+                applyMemorySetting()
+            }
+        }
+
+        // Save into our state file if we're using one; which will also alternate with the previous save,
+        // while only taking up space for one. Otherwise, we save everything into a fresh qcow snapshot.
+        if activeSnapshotMode != "savevm" {
+            if saveStateToFile() {
+                setResumeImage(tag: QEMUInterface.stateFileResumeTag)
+                recordSaveSize(QEMUInterface.stateFileResumeTag, trim: trim)
+                savedTag = QEMUInterface.stateFileResumeTag
+            }
+        } else if saveStateAndWait(tag: nextTag) == nil {
+            setResumeImage(tag: nextTag)
+            recordSaveSize(nextTag, trim: trim)
+            savedTag = nextTag
+        }
+    }
+
+    /// Cuts short any background save in progress; e.g. because iOS is about to suspend us. Whatever state we were
+    /// saving is thrown away, and the state we had before stays marked as it was.
+    func cancelBackgroundSave() {
+        setSaveDeadline(.distantPast)
+        qmp?.execute("migrate_cancel")
+    }
+
+    /// Sets the time the background save in progress has to finish by.
+    private func setSaveDeadline(_ deadline: Date) {
+        saveDeadlineLock.lock()
+        saveDeadline = deadline
+        saveDeadlineLock.unlock()
+    }
+
+    /// Returns how long a wait in our background save can take: `limit`, or whatever's left before its deadline.
+    private func remainingSaveTime(upTo limit: TimeInterval) -> TimeInterval {
+        saveDeadlineLock.lock()
+        defer { saveDeadlineLock.unlock() }
+
+        return max(0, min(limit, saveDeadline.timeIntervalSinceNow))
+    }
+
+    /// Get the next 'instant resume' file image.
+    /// This ensures we never overwrite an image until our save is complete.
+    private func getNextInstantResumeTag() -> String {
+        let current = getImageProperty(diskName: getDiskName(), property: "resume_image", defaultValue: "b")
+
+        if current.last == "b" {
+            return "\(QEMUInterface.instantResumePrefix)a"
+        } else {
+            return "\(QEMUInterface.instantResumePrefix)b"
+        }
+    }
+
+
+    //
+    // Snapshot catalog.
+    //
+
+    /// Returns the saved states we have for our current disk: its qcow snapshots, plus our state-file save
+    /// if we have one. Returns nil if we couldn't ask QEMU about its snapshots.
+    func listSnapshots() -> [SnapshotInfo]? {
+        guard let qcowSnapshots = queryQcowSnapshots() else {
+            return nil
+        }
+
+        recordRestoreTiming()
+
+        let catalog = getSnapshotCatalog()
+        let resumeImage = getResumeImage()
+        var snapshots : [SnapshotInfo] = []
+
+        // QEMU knows the size and age of each of its snapshots; we add how long each took to save and restore...
+        for snapshot in qcowSnapshots {
+            guard let name = snapshot["name"] as? String else {
+                continue
+            }
+
+            let record = catalog[name] ?? SnapshotRecord()
+            snapshots.append(SnapshotInfo(name: name,
+                                          vm_state_size: (snapshot["vm-state-size"] as? NSNumber)?.uint64Value ?? 0,
+                                          date: (snapshot["date-sec"] as? NSNumber)?.uint64Value ?? 0,
+                                          save_ms: record.save_ms, load_ms: record.load_ms, complete: record.complete,
+                                          ram_before_trim: record.ram_before_trim, ram_after_trim: record.ram_after_trim,
+                                          resume_image: name == resumeImage))
+        }
+
+        // ... and our state file lives outside of the disk, so we size it up ourselves.
+        let stateFile = getStateFileURL()
+        if let attributes = try? FileManager.default.attributesOfItem(atPath: stateFile.path) {
+            let name = QEMUInterface.stateFileResumeTag
+            let record = catalog[name] ?? SnapshotRecord()
+            let date = (attributes[.modificationDate] as? Date)?.timeIntervalSince1970 ?? 0
+
+            // In "state_file" mode, the guest's RAM is part of the saved state; it just lives in our memory file.
+            var size = (attributes[.size] as? NSNumber)?.uint64Value ?? 0
+            if activeSnapshotMode == "state_file" {
+                size += QEMUInterface.getAllocatedSize(getMemoryFileURL())
+            }
+
+            snapshots.append(SnapshotInfo(name: name, vm_state_size: size, date: UInt64(date),
+                                          save_ms: record.save_ms, load_ms: record.load_ms, complete: isStateFileValid() && record.complete,
+                                          ram_before_trim: record.ram_before_trim, ram_after_trim: record.ram_after_trim,
+                                          resume_image: name == resumeImage))
+        }
+
+        return snapshots
+    }
+
+    /// Returns a summary of the storage our saved states are using; or nil if we couldn't ask QEMU about them.
+    func getSnapshotStats() -> SnapshotStats? {
+        guard let snapshots = listSnapshots() else {
+            return nil
+        }
+
+        // Our disk is made up of our disk image, and any overlay layers on top of it.
+        let diskFiles = [getPersistentStore()] + getDiskLayers().map { getDiskLayerURL($0) }
+        let totals = getSaveSizeTotals()
+
+        return SnapshotStats(snapshot_count: snapshots.count,
+                             vm_state_bytes: snapshots.reduce(0) { $0 + $1.vm_state_size },
+                             disk_file_bytes: diskFiles.reduce(0) { $0 + QEMUInterface.getAllocatedSize($1) },
+                             state_file_bytes: QEMUInterface.getAllocatedSize(getStateFileURL()),
+                             memory_file_bytes: QEMUInterface.getAllocatedSize(getMemoryFileURL()),
+                             trimmed_save_count: totals.trimmed_saves,
+                             trimmed_save_bytes: (totals.trimmed_saves > 0) ? totals.trimmed_bytes / UInt64(totals.trimmed_saves) : nil,
+                             untrimmed_save_count: totals.untrimmed_saves,
+                             untrimmed_save_bytes: (totals.untrimmed_saves > 0) ? totals.untrimmed_bytes / UInt64(totals.untrimmed_saves) : nil)
+    }
+
+    /// Deletes a saved state, freeing the space it takes up. Returns nil on success, or a description of why we couldn't.
+    func deleteSnapshot(name: String) -> String? {
+        snapshotLock.lock()
+        defer { snapshotLock.unlock() }
+
+        guard let snapshots = listSnapshots() else {
+            return "could not read snapshots from QEMU"
+        }
+        guard snapshots.contains(where: { $0.name == name }) else {
+            return "no snapshot named \(name)"
+        }
+        guard !QEMUInterface.protectedSnapshots.contains(name) else {
+            return "\(name) is needed for clean boots, and can't be deleted"
+        }
+
+        // Our state file is just a file; but our memory file is also our running guest's RAM, so it stays.
+        if name == QEMUInterface.stateFileResumeTag {
+            setStateFileValid(false)
+            try? FileManager.default.removeItem(at: getStateFileURL())
+        }
+        // QEMU 7.0 only offers snapshot deletion via HMP; and tells us about any errors in its output.
+        else {
+            guard let output = qmp?.humanMonitorCommand("delvm \(name)"), !output.contains("Error") else {
+                return "QEMU could not delete \(name)"
+            }
+        }
+
+        // If we were going to resume from this state, we'll now have to boot fresh.
+        if name == getResumeImage() {
+            setResumeImage(tag: "")
+        }
+
+        var catalog = getSnapshotCatalog()
+        catalog[name] = nil
+        setSnapshotCatalog(catalog)
+
+        return nil
+    }
+
+    /// Deletes instant-resume snapshots we'll never resume from again -- that is, any but our current resume image,
+    /// as we only ever need the previous one until a newer save completes -- along with catalog entries for
+    /// snapshots that no longer exist. Waits on QEMU; so shouldn't be called from the main thread.
+    func pruneSnapshots() {
+        snapshotLock.lock()
+        defer { snapshotLock.unlock() }
+
+        guard let snapshots = listSnapshots() else {
+            return
+        }
+
+        // Leave alone anything whose save we never saw finish; we may need it to find out what went wrong.
+        let resumeImage = getResumeImage()
+        for snapshot in snapshots where snapshot.name.hasPrefix(QEMUInterface.instantResumePrefix) {
+            if (snapshot.name != resumeImage) && snapshot.complete && (deleteSnapshot(name: snapshot.name) == nil) {
+                NSLog("pruned stale snapshot \(snapshot.name), freeing \(snapshot.vm_state_size) bytes of VM state")
+            }
+        }
+
+        let names = Set(snapshots.map { $0.name })
+        setSnapshotCatalog(getSnapshotCatalog().filter { names.contains($0.key) })
+    }
+
+    /// Asks QEMU for the internal snapshots in our disk image; or returns nil if we can't reach it.
+    /// Snapshots can be in any of our disk's layers; though they're all in our disk image, unless someone's taken one
+    /// by hand while running on an overlay.
+    private func queryQcowSnapshots() -> [[String: Any]]? {
+        guard let images = queryDiskImages() else {
+            return nil
+        }
+
+        // Images without snapshots just leave the list out; and a thin disk's base image is read-only,
+        // so its snapshots aren't ones we can load or delete.
+        let baseImage = getThinDiskBase()?.lastPathComponent
+        return images
+            .filter { ($0["filename"] as? String).map { URL(fileURLWithPath: $0).lastPathComponent } != baseImage }
+            .flatMap { $0["snapshots"] as? [[String: Any]] ?? [] }
+    }
+
+    /// Asks QEMU about each of the images that make up our disk, from the guest's top layer on down;
+    /// or returns nil if we can't reach it.
+    private func queryDiskImages() -> [[String: Any]]? {
+        guard case .success(let result) = qmp?.executeAndWait("query-block"),
+              let devices = result as? [[String: Any]] else {
+            return nil
+        }
+
+        let disk = devices.first { $0["device"] as? String == QEMUInterface.diskDriveId }
+        var image = (disk?["inserted"] as? [String: Any])?["image"] as? [String: Any]
+        var images : [[String: Any]] = []
+
+        while let current = image {
+            images.append(current)
+            image = current["backing-image"] as? [String: Any]
+        }
+
+        return images
+    }
+
+    /// Notes that a save into the given snapshot finished, and how long it took.
+    private func recordCompletedSave(_ name: String, started: Date) {
+        updateSnapshotRecord(name) {
+            $0.complete = true
+            $0.save_ms = Date().timeIntervalSince(started) * 1000
+        }
+    }
+
+    /// Notes how much state we just saved into the given snapshot, and how far we trimmed the guest's RAM first;
+    /// and adds it to our totals for saves with and without trimming, so we can see what trimming buys us.
+    private func recordSaveSize(_ name: String, trim: (before: UInt64, after: UInt64)?) {
+        let size : UInt64
+        if name == QEMUInterface.stateFileResumeTag {
+            size = QEMUInterface.getAllocatedSize(getStateFileURL())
+        } else {
+            let snapshot = queryQcowSnapshots()?.first { $0["name"] as? String == name }
+            size = (snapshot?["vm-state-size"] as? NSNumber)?.uint64Value ?? 0
+        }
+
+        updateSnapshotRecord(name) {
+            $0.ram_before_trim = trim?.before
+            $0.ram_after_trim = trim?.after
+        }
+
+        var totals = getSaveSizeTotals()
+        if trim != nil {
+            totals.trimmed_saves += 1
+            totals.trimmed_bytes += size
+        } else {
+            totals.untrimmed_saves += 1
+            totals.untrimmed_bytes += size
+        }
+        setSaveSizeTotals(totals)
+
+        if let trim = trim {
+            NSLog("saved \(size >> 20) MiB of VM state, with guest RAM trimmed from \(trim.before >> 20) MiB to \(trim.after >> 20) MiB")
+        } else {
+            NSLog("saved \(size >> 20) MiB of VM state, without trimming guest RAM")
+        }
+    }
+
+    /// Returns our totals for the saves we've made in our current snapshot mode; which each save in a different way,
+    /// so they're kept apart.
+    private func getSaveSizeTotals() -> SaveSizeTotals {
+        let property = "save_size_totals_\(activeSnapshotMode)"
+        let serializedString = getImageProperty(diskName: getDiskName(), property: property, defaultValue: "{}")
+        return (try? JSONDecoder().decode(SaveSizeTotals.self, from: Data(serializedString.utf8))) ?? SaveSizeTotals()
+    }
+
+    /// Stores our totals for the saves we've made in our current snapshot mode.
+    private func setSaveSizeTotals(_ totals: SaveSizeTotals) {
+        guard let encoded = try? JSONEncoder().encode(totals) else {
+            return
+        }
+        setImageProperty(diskName: getDiskName(), property: "save_size_totals_\(activeSnapshotMode)",
+                         value: String(decoding: encoded, as: UTF8.self))
+    }
+
+    /// Notes how long it took to restore the state our running VM was booted from, once the VM is up and running.
+    /// We count from our call into QEMU, which covers loading both qcow snapshots and state files.
+    private func recordRestoreTiming() {
+        guard let name = pendingRestoreTiming else {
+            return
+        }
+
+        let started = launch_trace_elapsed_ms(LAUNCH_PHASE_QEMU_START)
+        let running = launch_trace_elapsed_ms(LAUNCH_PHASE_FIRST_VCPU_RUN)
+        if (started < 0) || (running < 0) {
+            return
+        }
+
+        updateSnapshotRecord(name) { $0.load_ms = running - started }
+        pendingRestoreTiming = nil
+    }
+
+    /// Returns our records for each of the current disk's snapshots, by snapshot name.
+    private func getSnapshotCatalog() -> [String: SnapshotRecord] {
+        let serializedString = getImageProperty(diskName: getDiskName(), property: "snapshot_catalog", defaultValue: "{}")
+        let catalog = try? JSONDecoder().decode([String: SnapshotRecord].self, from: Data(serializedString.utf8))
+        return catalog ?? [:]
+    }
+
+    /// Replaces our records of the current disk's snapshots.
+    private func setSnapshotCatalog(_ catalog: [String: SnapshotRecord]) {
+        let serializedData = try! JSONEncoder().encode(catalog)
+        setImageProperty(diskName: getDiskName(), property: "snapshot_catalog", value: String(data: serializedData, encoding: .utf8)!)
+    }
+
+    /// Updates our record of a single snapshot.
+    private func updateSnapshotRecord(_ name: String, update: (inout SnapshotRecord) -> Void) {
+        var catalog = getSnapshotCatalog()
+        var record = catalog[name] ?? SnapshotRecord()
+
+        update(&record)
+        catalog[name] = record
+        setSnapshotCatalog(catalog)
+    }
+
+    /// Returns how much storage a file actually takes up; which, for our sparse files, can be far less than its size.
+    private static func getAllocatedSize(_ url: URL) -> UInt64 {
+        let values = try? url.resourceValues(forKeys: [.totalFileAllocatedSizeKey])
+        return UInt64(values?.totalFileAllocatedSize ?? 0)
+    }
+
+
+    //
+    // Disk layers.
+    //
+    // In "overlay_state" mode, each save freezes the disk as it was at that instant, by starting a new external qcow2
+    // overlay for the guest to write into. Our state file and the frozen layer below the guest's then make up a resume
+    // point that stays good however long the guest keeps running; and we never write internal snapshots, which bloat
+    // our disk image's metadata and fragment its clusters. In the background, layers are merged back down into our
+    // disk image, so the guest never runs more than a couple of layers deep.
+    //
+
+    /// Returns the overlay layers stacked on our disk image, bottom-most first, as filenames in our datastore.
+    private func getDiskLayers() -> [String] {
+        let serializedString = getImageProperty(diskName: getDiskName(), property: "disk_layers", defaultValue: "[]")
+        let layers = try? JSONDecoder().decode([String].self, from: Data(serializedString.utf8))
+        return layers ?? []
+    }
+
+    /// Replaces our list of overlay layers.
+    private func setDiskLayers(_ layers: [String]) {
+        let serializedData = try! JSONEncoder().encode(layers)
+        setImageProperty(diskName: getDiskName(), property: "disk_layers", value: String(data: serializedData, encoding: .utf8)!)
+    }
+
+    /// Returns the layer frozen by our last overlay save; or nil if that's our disk image itself.
+    private func getResumeLayer() -> String? {
+        let layer = getImageProperty(diskName: getDiskName(), property: "resume_layer", defaultValue: "")
+        return layer.isEmpty ? nil : layer
+    }
+
+    /// Sets the layer frozen by our last overlay save.
+    private func setResumeLayer(_ layer: String?) {
+        setImageProperty(diskName: getDiskName(), property: "resume_layer", value: layer ?? "")
+    }
+
+    /// Returns the location of a disk layer; with nil meaning our disk image itself.
+    private func getDiskLayerURL(_ layer: String?) -> URL {
+        guard let layer = layer else {
+            return getPersistentStore()
+        }
+
+        var url = getPersistentStore().deletingLastPathComponent()
+        url.appendPathComponent(layer)
+        return url
+    }
+
+    /// Deletes the files for the given disk layers.
+    private func removeDiskLayers(_ layers: [String]) {
+        for layer in layers {
+            try? FileManager.default.removeItem(at: getDiskLayerURL(layer))
+        }
+    }
+
+    /// Sorts out our disk layers for a new boot, and returns the image the guest should be started on.
+    private func configureDiskLayers(bootImageName: String?, resume: Bool) -> URL {
+        let layers = getDiskLayers()
+
+        // Loading a qcow snapshot reverts the disk to match it; and our snapshots live in our disk image itself.
+        // So anything in layers above that would be thrown away anyway.
+        if let bootImageName = bootImageName, bootImageName != QEMUInterface.stateFileResumeTag, !layers.isEmpty {
+            removeDiskLayers(layers)
+            setDiskLayers([])
+            setResumeLayer(nil)
+            return getPersistentStore()
+        }
+
+        // Resuming from an overlay save starts the guest on the disk exactly as it was saved;
+        // finishOverlayResume() then gives it a fresh layer, before it runs.
+        if resume && (activeSnapshotMode == "overlay_state") {
+            return getDiskLayerURL(getResumeLayer())
+        }
+
+        // Otherwise, the guest carries on from the latest version of its disk.
+        return getDiskLayerURL(layers.last)
+    }
+
+    /// Starts a new overlay layer on top of the guest's disk, for it to write into from now on; which leaves the layer
+    /// below frozen. Returns the new layer's name; or nil if we couldn't create it.
+    /// Must be called with our snapshot lock held, and ideally with the VM paused.
+    private func addDiskLayer() -> String? {
+        guard let qmp = qmp else {
+            return nil
+        }
+
+        // A merge could be changing the layers below us; so let that stop before we add to them.
+        cancelDiskMerge()
+
+        // Each layer gets a new number, so neither its name nor its QEMU node name is ever reused.
+        let layers = getDiskLayers()
+        let number = Int(getImageProperty(diskName: getDiskName(), property: "disk_layer_count", defaultValue: "0")) ?? 0
+        setImageProperty(diskName: getDiskName(), property: "disk_layer_count", value: String(number + 1))
+
+        let layer = "\(getDiskName())_layer_\(number).qcow"
+        let nodeName = "layer-\(number)"
+        let result = qmp.executeAndWait("blockdev-snapshot-sync", arguments: [
+            "device": QEMUInterface.diskDriveId,
+            "snapshot-file": getDiskLayerURL(layer).path,
+            "snapshot-node-name": nodeName,
+            "format": "qcow2",
+        ])
+        guard case .success = result else {
+            NSLog("could not create disk layer \(layer): \(result)")
+            try? FileManager.default.removeItem(at: getDiskLayerURL(layer))
+            return nil
+        }
+
+        // QEMU points the new layer at the absolute path of the one below it; but our container moves whenever
+        // the app is updated, so point it at that layer's name, relative to its own.
+        qmp.executeAndWait("change-backing-file", arguments: [
+            "device": QEMUInterface.diskDriveId,
+            "image-node-name": nodeName,
+            "backing-file": getDiskLayerURL(layers.last).lastPathComponent,
+        ])
+
+        setDiskLayers(layers + [layer])
+        return layer
+    }
+
+    /// Once our VM has loaded its state from an overlay save, starts a fresh layer on top of the frozen one for the guest
+    /// to write into, throws away the layers it wrote into after that save, and lets it run.
+    private func finishOverlayResume() {
+        DispatchQueue.global(qos: .userInitiated).async { [weak self] in
+            guard let self = self, let qmp = self.qmp else {
+                return
+            }
+
+            // QEMU answers once it's up, and reports itself as "inmigrate" until it's loaded our state;
+            // after which it waits for us, paused. We wait without our snapshot lock, so a save isn't stuck behind us.
+            if self.waitForRunState(timeout: QEMUInterface.overlayResumeTimeout, until: { $0 != "inmigrate" }) == nil {
+                NSLog("timed out waiting for VM state to load; not resuming")
+                return
+            }
+
+            self.snapshotLock.lock()
+            defer { self.snapshotLock.unlock() }
+
+            // Anything the guest wrote after our save is now stale.
+            let layers = self.getDiskLayers()
+            let resumeIndex = self.getResumeLayer().flatMap { layers.firstIndex(of: $0) }
+            let kept = resumeIndex.map { Array(layers[...$0]) } ?? []
+            self.setDiskLayers(kept)
+            self.removeDiskLayers(layers.filter { !kept.contains($0) })
+
+            // If we can't give the guest a layer of its own, it'll be writing into the one our state depends on.
+            if self.addDiskLayer() == nil {
+                self.setStateFileValid(false)
+            }
+
+            self.resume()
+            self.mergeDiskLayers()
+        }
+    }
+
+    /// Waits until QEMU's run state (e.g. "inmigrate", "paused" or "running") satisfies `done`; and returns that state,
+    /// or nil if we gave up waiting. We check the state each time QEMU tells us it's changed; and now and then regardless,
+    /// since QEMU may not be answering QMP yet, and can finish loading state without reporting a change.
+    private func waitForRunState(timeout: TimeInterval, until done: (String) -> Bool) -> String? {
+        guard let qmp = qmp else {
+            return nil
+        }
+        let deadline = Date().addingTimeInterval(timeout)
+
+        // Subscribe before we look, so we can't miss a change between looking and waiting.
+        let changed = DispatchSemaphore(value: 0)
+        let subscriptions = ["STOP", "RESUME", "MIGRATION"].map {
+            (event: $0, token: qmp.subscribe(to: $0) { _, _ in changed.signal() })
+        }
+        defer {
+            for subscription in subscriptions {
+                qmp.unsubscribe(from: subscription.event, token: subscription.token)
+            }
+        }
+
+        while true {
+            if case .success(let result) = qmp.executeAndWait("query-status", timeout: max(deadline.timeIntervalSinceNow, 0)),
+               let status = (result as? [String: Any])?["status"] as? String, done(status) {
+                return status
+            }
+
+            let remaining = deadline.timeIntervalSinceNow
+            if remaining <= 0 {
+                return nil
+            }
+            _ = changed.wait(timeout: .now() + min(remaining, QEMUInterface.runStateRecheckInterval))
+        }
+    }
+
+    /// Starts merging our disk's overlay layers back down into our disk image, in the background; if there are any
+    /// we can merge. While we have an overlay save to resume from, we merge everything up to the layer it depends on,
+    /// and the guest's own layer stays on top. Otherwise, nothing depends on our layers, so we merge all of them.
+    func mergeDiskLayers() {
+        snapshotLock.lock()
+        defer { snapshotLock.unlock() }
+
+        let layers = getDiskLayers()
+        guard let qmp = qmp, !diskMergeRunning, !layers.isEmpty else {
+            return
+        }
+
+        var arguments : [String: Any] = [
+            "device": QEMUInterface.diskDriveId,
+            "job-id": QEMUInterface.diskMergeJobId,
+            "base": getPersistentStore().path,
+            "speed": QEMUInterface.diskMergeSpeed,
+        ]
+
+        // When we merge from below the guest's layer, QEMU rewrites the backing file of the layer above;
+        // which should find our disk image by its name, just as our own layers do.
+        if (activeSnapshotMode == "overlay_state") && isStateFileValid() {
+            guard let resumeLayer = getResumeLayer(), resumeLayer != layers.last else {
+                return
+            }
+
+            arguments["top"] = getDiskLayerURL(resumeLayer).path
+            arguments["backing-file"] = getPersistentStore().lastPathComponent
+        }
+
+        // Merging the guest's own layer mirrors its writes into our disk image until the two match, and then
+        // waits for us to switch it over. Either way, we tidy up once the merge is over.
+        diskMergeGeneration += 1
+        let generation = diskMergeGeneration
+        let handler : QMPClient.EventHandler = { [weak self] event, data in
+            guard data["device"] as? String == QEMUInterface.diskMergeJobId else {
+                return
+            }
+
+            if event == "BLOCK_JOB_READY" {
+                qmp.execute("block-job-complete", arguments: ["device": QEMUInterface.diskMergeJobId])
+            } else {
+                DispatchQueue.global(qos: .utility).async {
+                    self?.finishDiskMerge(generation: generation)
+                }
+            }
+        }
+        diskMergeSubscriptions = ["BLOCK_JOB_READY", "BLOCK_JOB_COMPLETED", "BLOCK_JOB_CANCELLED"].map {
+            (event: $0, token: qmp.subscribe(to: $0, handler: handler))
+        }
+
+        let result = qmp.executeAndWait("block-commit", arguments: arguments)
+        guard case .success = result else {
+            NSLog("could not start merging disk layers: \(result)")
+            unsubscribeFromDiskMerge()
+            return
+        }
+
+        diskMergeRunning = true
+    }
+
+    /// Stops any disk-layer merge in progress, and waits for QEMU to let go of it; e.g. so a save can add a layer.
+    /// Whatever was merged so far stays merged; so it's safe to stop at any point. Must be called with our snapshot lock held.
+    private func cancelDiskMerge() {
+        guard diskMergeRunning, let qmp = qmp else {
+            return
+        }
+
+        let stopped = DispatchSemaphore(value: 0)
+        let subscriptions = ["BLOCK_JOB_COMPLETED", "BLOCK_JOB_CANCELLED"].map { event in
+            (event: event, token: qmp.subscribe(to: event) { _, data in
+                if data["device"] as? String == QEMUInterface.diskMergeJobId {
+                    stopped.signal()
+                }
+            })
+        }
+        defer {
+            for subscription in subscriptions {
+                qmp.unsubscribe(from: subscription.event, token: subscription.token)
+            }
+        }
+
+        qmp.executeAndWait("block-job-cancel", arguments: ["device": QEMUInterface.diskMergeJobId, "force": true])
+        if stopped.wait(timeout: .now() + remainingSaveTime(upTo: QEMUInterface.diskMergeCancelTimeout)) == .timedOut {
+            NSLog("timed out waiting for our disk merge to stop")
+        }
+
+        finishDiskMerge(generation: diskMergeGeneration)
+    }
+
+    /// Brings our list of disk layers up to date once a merge is over; however it ended.
+    private func finishDiskMerge(generation: Int) {
+        snapshotLock.lock()
+        defer { snapshotLock.unlock() }
+
+        // If we've already tidied up after this merge, there's nothing left to do.
+        if !diskMergeRunning || (generation != diskMergeGeneration) {
+            return
+        }
+
+        unsubscribeFromDiskMerge()
+        diskMergeRunning = false
+
+        // QEMU knows which layers the guest is actually running on; so trust it, rather than trying to work out
+        // how far a merge got before it was completed or cancelled. Our layers are everything above our disk image.
+        let diskImage = getPersistentStore().lastPathComponent
+        let chain = queryDiskImages()?.compactMap { ($0["filename"] as? String).map { URL(fileURLWithPath: $0).lastPathComponent } }
+        guard let chain = chain, chain.contains(diskImage) else {
+            NSLog("could not find our disk image in QEMU's view of our disk; leaving our layers as they are")
+            return
+        }
+        let layers = Array(chain.prefix { $0 != diskImage }.reversed())
+
+        // Any layer that's no longer in use has been merged, and can go. If that includes the one our resume point
+        // depended on, the same disk contents are now in our disk image.
+        removeDiskLayers(getDiskLayers().filter { !layers.contains($0) })
+        setDiskLayers(layers)
+        if let resumeLayer = getResumeLayer(), !layers.contains(resumeLayer) {
+            setResumeLayer(nil)
+        }
+    }
+
+    /// Drops our subscriptions to events about our disk merge.
+    private func unsubscribeFromDiskMerge() {
+        for subscription in diskMergeSubscriptions {
+            qmp?.unsubscribe(from: subscription.event, token: subscription.token)
+        }
+        diskMergeSubscriptions = []
+    }
+
+
+    //
+    // Guest memory.
+    //
+    // The guest always boots with the memory it did last time, so our saved states keep loading; and its memory
+    // balloon shrinks it to whatever the user has asked for, or further, when iOS is running short. Pages in the
+    // balloon are handed back to iOS, rather than counting against us until we're killed. That only works when guest
+    // RAM is anonymous memory; so when it lives in our memory file, the guest gets no balloon (see balloonRequested()).
+    //
+
+    /// Brings the guest's memory to what the memory setting asks for; e.g. after the setting has changed.
+    func applyMemorySetting() {
+        memoryQueue.async { [weak self] in
+            self?.applyGuestMemoryTarget()
+        }
+    }
+
+    /// Gives memory back to iOS, when it warns us it's running short, by halving the memory the guest may use.
+    /// The guest gets its memory back once iOS has gone a while without warning us again.
+    func relieveMemoryPressure() {
+        if !UserDefaults.standard.bool(forKey: "last_memory_balloon") {
+            NSLog("can't give memory back to iOS: the guest was booted without a balloon")
+            return
+        }
+
+        memoryQueue.async { [weak self] in
+            guard let self = self, let current = self.memoryPressureTarget ?? self.getGuestMemory() else {
+                return
+            }
+
+            let target = max(current / 2, QEMUInterface.minimumGuestMemory)
+            self.memoryPressureTarget = target
+            self.memoryPressureGeneration += 1
+            self.applyGuestMemoryTarget()
+            HostEvent.memoryPressure.post(value: String(target))
+
+            let generation = self.memoryPressureGeneration
+            self.memoryQueue.asyncAfter(deadline: .now() + QEMUInterface.memoryPressureRecoveryDelay) { [weak self] in
+                guard let self = self, generation == self.memoryPressureGeneration else {
+                    return
+                }
+
+                self.memoryPressureTarget = nil
+                self.applyGuestMemoryTarget()
+                HostEvent.memoryRecovered.post()
+            }
+        }
+    }
+
+    /// Returns how much memory the guest currently has to use, in bytes; or nil if it doesn't have a balloon,
+    /// or we can't reach QEMU.
+    func getGuestMemory() -> UInt64? {
+        guard case .success(let result) = qmp?.executeAndWait("query-balloon"),
+              let actual = (result as? [String: Any])?["actual"] as? NSNumber else {
+            return nil
+        }
+        return actual.uint64Value
+    }
+
+    /// Has the guest report its memory statistics through its balloon, so we know how much of its RAM it could give up.
+    private func enableBalloonStats() {
+        guard UserDefaults.standard.bool(forKey: "last_memory_balloon"), let qmp = qmp else {
+            return
+        }
 
-        // ... get a filename for our unix domain monitor-connection socket ...
-        monitorSocketPath = getDatastoreURL("monitor", fileExtension: "socket").path
-        
-        // ... and start up the QEMU kernel, which will start paused.
-        run_background_qemu(qemuImage, kernelPath, initrdPath, bundlePrefix, diskPath, sharedFolder, bootImageName, memoryValue, monitorSocketPath, AppDelegate.usingJitHacks);
+        let result = qmp.executeAndWait("qom-set", arguments: ["path": QEMUInterface.balloonPath,
+                                                               "property": "guest-stats-polling-interval",
+                                                               "value": QEMUInterface.balloonStatsInterval])
+        if case .failure(let error) = result {
+            NSLog("could not turn on guest memory statistics: \(error)")
+        }
+    }
 
-        // Mark the amount of memory we booted with, for next time.
-        setLastMemoryValue(value: memoryValue)
+    /// Returns how much of its RAM the guest last reported as free, and as (droppable) page cache, in bytes;
+    /// or nil if it hasn't reported them.
+    private func getGuestFreeMemory() -> (free: UInt64, cache: UInt64)? {
+        guard case .success(let result) = qmp?.executeAndWait("qom-get", arguments: ["path": QEMUInterface.balloonPath,
+                                                                                    "property": "guest-stats"]),
+              let guestStats = result as? [String: Any],
+              ((guestStats["last-update"] as? NSNumber)?.int64Value ?? 0) > 0,
+              let stats = guestStats["stats"] as? [String: Any] else {
+            return nil
+        }
 
-        // Finally, recreate our persistent mounts, so they're available in the VM.
-        recreatePersistentMounts()
-    }
-    
-    /// Saves the state of the running QEMU instance.
-    /// With no arguments, updates the Instant Boot cache.
-    func saveState(tag: String) {
-        issueMonitorCommand("savevm \(tag)")
-    }
-    
-    /// Saves the state of the running QEMU instance.
-    /// With no arguments, loads from the Instant Boot cache.
-    func loadState(tag: String) {
-        issueMonitorCommand("loadvm \(tag)")
-        issueMonitorCommand("c")
+        // Statistics the guest doesn't report come back as -1.
+        guard let free = (stats["stat-free-memory"] as? NSNumber)?.int64Value, free >= 0,
+              let cache = (stats["stat-disk-caches"] as? NSNumber)?.int64Value, cache >= 0 else {
+            return nil
+        }
+        return (UInt64(free), UInt64(cache))
     }
 
-    /// Saves the state of the running QEMU instance in a background-safe manner.
-    func performBackgroundSave() {
-        if let terminal = ViewController.getCurrentTerminal() {
-            let nextTag = getNextInstantResumeTag()
+    /// Squeezes the guest's RAM down before a save, so there's less of it to write. We inflate our balloon by what the
+    /// guest last told us it has free or in its page cache, less some headroom; so the guest gives up free pages, and
+    /// drops clean cache to make up the rest, without being pushed into swap. The pages it gives up are saved as
+    /// zeroes. The caller gives the guest its memory back once the save is done.
+    /// Returns how much RAM the guest had before and after, in bytes; or nil if we didn't trim it.
+    private func trimGuestMemory() -> (before: UInt64, after: UInt64)? {
+        guard UserDefaults.standard.bool(forKey: "memory_trim"), UserDefaults.standard.bool(forKey: "last_memory_balloon"),
+              let qmp = qmp, let before = getGuestMemory(), let reported = getGuestFreeMemory() else {
+            return nil
+        }
 
-            // Never take a snapshot before we've connected to our VM.
-            if (!terminal.connected) {
-                return;
+        // Only ask for what the guest says it can spare.
+        let spare = reported.free + reported.cache
+        guard spare > QEMUInterface.memoryTrimHeadroom else {
+            return nil
+        }
+        let target = max(before - min(before, spare - QEMUInterface.memoryTrimHeadroom), QEMUInterface.minimumGuestMemory)
+        guard target < before else {
+            return nil
+        }
+
+        // QEMU tells us each time the guest hands pages over, as it frees them up.
+        let shrunk = DispatchSemaphore(value: 0)
+        let subscription = qmp.subscribe(to: "BALLOON_CHANGE") { _, data in
+            if (data["actual"] as? NSNumber) != nil {
+                shrunk.signal()
             }
+        }
+        defer { qmp.unsubscribe(from: "BALLOON_CHANGE", token: subscription) }
 
-            saveState(tag: nextTag)
-            Thread.sleep(forTimeInterval: TimeInterval(2))
-            setResumeImage(tag: nextTag)
+        guard case .success = qmp.executeAndWait("balloon", arguments: ["value": target]) else {
+            return nil
         }
-    }
 
-    /// Get the next 'instant resume' file image.
-    /// This ensures we never overwrite an image until our save is complete.
-    private func getNextInstantResumeTag() -> String {
-        let current = getImageProperty(diskName: getDiskName(), property: "resume_image", defaultValue: "b")
+        // Wait until the guest has stopped giving any more; or it's given all we asked for.
+        let deadline = Date().addingTimeInterval(remainingSaveTime(upTo: QEMUInterface.memoryTrimTimeout))
+        var after = before
+        while true {
+            let wait = min(QEMUInterface.memoryTrimSettleTime, deadline.timeIntervalSinceNow)
+            if (wait <= 0) || (shrunk.wait(timeout: .now() + wait) == .timedOut) {
+                break
+            }
 
-        if current.last == "b" {
-            return "instant_resume_a"
-        } else {
-            return "instant_resume_b"
+            guard let current = getGuestMemory() else {
+                break
+            }
+            after = min(after, current)
+            if current <= target {
+                break
+            }
         }
+
+        return (before, after)
     }
 
-    /// Starts or resumes the tctiSH instance's execution.
+    /// Sets our balloon so the guest has the memory the user has asked for; or less, while iOS is short on memory.
+    /// Must be called on our memory queue.
+    private func applyGuestMemoryTarget() {
+        guard UserDefaults.standard.bool(forKey: "last_memory_balloon"), let qmp = qmp,
+              let booted = QEMUInterface.parseMemorySize(getLastMemoryValue()) else {
+            return
+        }
+
+        // The balloon can only take memory away; so the guest can never have more than it booted with.
+        let requested = QEMUInterface.parseMemorySize(getMemoryValue()) ?? booted
+        let target = max(min(memoryPressureTarget ?? requested, requested, booted), QEMUInterface.minimumGuestMemory)
+
+        let result = qmp.executeAndWait("balloon", arguments: ["value": target])
+        if case .failure(let error) = result {
+            NSLog("could not set guest memory to \(target >> 20) MiB: \(error)")
+        }
+    }
+    /// Pauses the tctiSH instance's execution.
     func pause() {
-        issueMonitorCommand("halt")
+        qmp?.execute("stop")
     }
 
 
     /// Starts or resumes the tctiSH instance's execution.
     func resume() {
-        issueMonitorCommand("cont")
+        qmp?.execute("cont")
     }
 
     /// Terminates the SSH channel used for console comms.
     func stopHostChannels() {
-        issueMonitorCommand("hostfwd_remove \(QEMUInterface.sshHostForward)")
+        qmp?.execute("human-monitor-command", arguments: ["command-line": "hostfwd_remove \(QEMUInterface.sshHostForward)"])
     }
 
     /// Terminates the SSH channel used for console comms.
     func startHostChannels() {
-        issueMonitorCommand("hostfwd_add \(QEMUInterface.sshHostForward)")
+        qmp?.execute("human-monitor-command", arguments: ["command-line": "hostfwd_add \(QEMUInterface.sshHostForward)"])
     }
 
     /// Sets up the permissions for using a bookmarked folder.
@@ -159,18 +1534,26 @@ public class QEMUInterface {
     }
 
     /// Sets up a given host URL for mounting.
+    /// Returns the mount's tag once it's ready for the guest to use; or nil if it couldn't be made available.
     func mount(bookmarkData: Data, interfaceId: String? = nil, predefinedTag: String? = nil,
                persistent: Bool = true) -> String? {
         let tag = predefinedTag ?? generateMountTag(length: 6)
         let id = interfaceId ?? generateMountTag(length: 6)
 
-        let hostPath = setupMountPermissions(bookmarkData: bookmarkData)
+        guard let hostPath = setupMountPermissions(bookmarkData: bookmarkData) else {
+            return nil
+        }
+
+        // ... mount the target URL ...
+        guard let readyTag = mount(hostPath: hostPath, interfaceId: id, predefinedTag: tag) else {
+            return nil
+        }
 
-        // ... and, finally, mount the target URL.
+        // ... and, finally, remember it for next time, now that we know it works.
         if persistent {
             makeMountPersistent(bookmarkData: bookmarkData, interfaceId: id, tag: tag)
         }
-        return mount(hostPath: hostPath!, interfaceId: id, predefinedTag: tag)
+        return readyTag
     }
 
     /// Saves mount data into our "VM" configuration, so we can automatically remount it on startup.
@@ -242,12 +1625,14 @@ public class QEMUInterface {
 
 
     /// Sets up a given host URL for mounting.
-    func mount(hostPath: URL, interfaceId: String? = nil, predefinedTag: String? = nil) -> String {
+    func mount(hostPath: URL, interfaceId: String? = nil, predefinedTag: String? = nil) -> String? {
         return mount(hostPath: hostPath.path, interfaceId: interfaceId, predefinedTag: predefinedTag)
     }
 
-    /// Sets up a given host path for mounting.
-    func mount(hostPath: String, interfaceId: String? = nil, predefinedTag: String? = nil) -> String {
+    /// Sets up a given host path for mounting. Mounts are links in the folder we already share with the guest;
+    /// so there's no device to attach, and a mount is usable as soon as its link resolves.
+    /// Returns the mount's tag once it's ready for the guest to use; or nil if it couldn't be made available.
+    func mount(hostPath: String, interfaceId: String? = nil, predefinedTag: String? = nil) -> String? {
         let tag = predefinedTag ?? generateMountTag(length: 6)
 
         // Use our tag to get a unique symlink path...
@@ -260,6 +1645,16 @@ public class QEMUInterface {
         }
         try? FileManager.default.createSymbolicLink(atPath: symlinkDestination.path, withDestinationPath: hostPath)
 
+        // Only report the mount as ready once QEMU can actually get through to its target.
+        var isDirectory : ObjCBool = false
+        guard FileManager.default.fileExists(atPath: symlinkDestination.path, isDirectory: &isDirectory),
+              isDirectory.boolValue, FileManager.default.isReadableFile(atPath: symlinkDestination.path) else {
+            NSLog("mount \(tag) isn't reachable through our shared folder")
+            try? FileManager.default.removeItem(at: symlinkDestination)
+            return nil
+        }
+
+        HostEvent.mountReady.post(value: tag)
         return tag
     }
 
@@ -300,16 +1695,33 @@ public class QEMUInterface {
             mode = "recovery_boot"
         }
 
+        // A clean boot doesn't resume anything we've saved; so it isn't affected by hardware changes below.
+        if mode == "clean_boot" {
+            return prepareCleanBoot()
+        }
+
         // If our memory value has changed, force a recovery boot.
         if memoryValueChanged() {
             mode = "recovery_boot"
         }
+
+        // Saved states also capture the number of CPUs; so we can't resume across a change, either.
+        if cpuCountChanged() {
+            mode = "recovery_boot"
+        }
+
+        // ... or the rest of the VM's hardware.
+        if machineRevisionChanged() {
+            mode = "recovery_boot"
+        }
         
         switch mode {
         case "persistent_boot":
             let resume_image = getResumeImage()
             if isFirstBoot() {
                 return nil
+            } else if (resume_image == QEMUInterface.stateFileResumeTag) && !canResumeFromStateFile() {
+                return nil
             } else {
                 return resume_image
             }
@@ -317,14 +1729,30 @@ public class QEMUInterface {
             return UserDefaults.standard.string(forKey: "boot_snapshot")
         case "recovery_boot":
             return nil
-        case "clean_boot":
-            return "instantboot"
         default:
             NSLog("got invalid settings from settings pane! no boot mode \(String(describing: mode))")
             exit(1);
         }
     }
 
+    /// Gets our disk back to its pristine state, for a clean boot; and returns the image to boot from, if any.
+    private func prepareCleanBoot() -> String? {
+
+        // Thin disks don't carry our instant-boot snapshot; but a fresh thin disk is just as clean, and instant to make.
+        if getThinDiskBase() != nil {
+            resetThinDisk()
+            return nil
+        }
+
+        // A full copy is reverted by loading its instant-boot snapshot; unless the memory setting has changed since our
+        // last boot, as the snapshot only loads into the memory it was saved from. Then we start over from a fresh copy.
+        if getMemoryValue() != getLastMemoryValue() {
+            resetCopiedDisk()
+            return nil
+        }
+        return "instantboot"
+    }
+
     /// Returns a string indicating the currently used disc name.
     private func getDiskName() -> String {
         return UserDefaults.standard.string(forKey: "disk_name") ?? "disk"
@@ -345,11 +1773,248 @@ public class QEMUInterface {
         return UserDefaults.standard.set(value, forKey: "last_memory")
     }
 
-    /// Returns true iff the memory setting has changed since the last boot.
+    /// Returns true iff the memory setting has changed since the last boot, in a way that needs a new boot to apply.
+    /// With a balloon, the guest can shrink to anything up to the memory it booted with, without losing its state;
+    /// but adding or removing the balloon changes the VM's devices, which our saved states can't survive.
     func memoryValueChanged() -> Bool {
+        let useBalloon = balloonRequested()
+        if useBalloon != UserDefaults.standard.bool(forKey: "last_memory_balloon") {
+            return true
+        }
+
+        if useBalloon, let requested = QEMUInterface.parseMemorySize(getMemoryValue()),
+           let booted = QEMUInterface.parseMemorySize(getLastMemoryValue()) {
+            return requested > booted
+        }
+
         return getMemoryValue() != getLastMemoryValue()
     }
 
+    /// Returns the memory to boot the VM with. Saved states only load into as much memory as they were saved from;
+    /// so unless we're cold-booting anyway, we keep the memory we booted with last, and let our balloon shrink the
+    /// guest to what's been asked for.
+    private func getBootMemoryValue(coldBoot: Bool) -> String {
+        if coldBoot || memoryValueChanged() {
+            return getMemoryValue()
+        }
+        return getLastMemoryValue()
+    }
+
+    /// Converts a QEMU-style memory size (e.g. "512M" or "2G") into bytes.
+    static func parseMemorySize(_ value: String) -> UInt64? {
+        let multipliers : [Character: UInt64] = ["K": 1 << 10, "M": 1 << 20, "G": 1 << 30, "T": 1 << 40]
+
+        guard let suffix = value.uppercased().last else {
+            return nil
+        }
+
+        if let multiplier = multipliers[suffix] {
+            return UInt64(value.dropLast()).map { $0 * multiplier }
+        }
+
+        // QEMU treats bare numbers as MiB.
+        return UInt64(value).map { $0 << 20 }
+    }
+
+    /// Returns the size of TCG's translation buffer, in MiB.
+    ///
+    /// In "auto" mode, we give the translator a quarter of the guest's memory size, but never more
+    /// than a quarter of what the host has left once the guest's RAM is accounted for -- translated
+    /// code that gets us jetsam'd is worse than translated code that gets flushed.
+    private func getTbSize() -> UInt64 {
+        let setting = UserDefaults.standard.string(forKey: "tb_size") ?? "auto"
+        if let size = UInt64(setting) {
+            return size
+        }
+
+        let guestMemory = (QEMUInterface.parseMemorySize(getMemoryValue()) ?? (1 << 30)) >> 20
+        let hostMemory = ProcessInfo.processInfo.physicalMemory >> 20
+        let hostHeadroom = (hostMemory > guestMemory) ? (hostMemory - guestMemory) : 0
+
+        let size = min(guestMemory / 4, hostHeadroom / 4)
+        return max(QEMUInterface.minimumTbSize, min(size, QEMUInterface.maximumTbSize))
+    }
+
+    /// Returns the number of vCPUs to give our VM.
+    /// In "auto" mode, we give the guest one vCPU per host performance core.
+    private func getCpuCount() -> Int {
+        let setting = UserDefaults.standard.string(forKey: "cpu_count") ?? "auto"
+        return Int(setting) ?? QEMUInterface.getHostPerformanceCoreCount()
+    }
+
+    /// Returns the TCG threading mode to use; either "multi" (one host thread per vCPU) or "single".
+    private func getTcgThreadMode() -> String {
+        return UserDefaults.standard.string(forKey: "tcg_thread_mode") ?? "multi"
+    }
+
+    /// Returns how many threads to compress saved RAM with, and to decompress it with on resume.
+    /// By default, we use one per performance core; QEMU allows at most 255.
+    private static func getSnapshotThreadCount() -> Int {
+        let setting = UserDefaults.standard.string(forKey: "snapshot_threads") ?? "auto"
+        return min(Int(setting) ?? getHostPerformanceCoreCount(), 255)
+    }
+
+    /// Returns the number of performance cores on the host.
+    /// Falls back to all active cores on hosts that don't distinguish core types.
+    private static func getHostPerformanceCoreCount() -> Int {
+        var cores : Int32 = 0
+        var size = MemoryLayout<Int32>.size
+
+        if sysctlbyname("hw.perflevel0.physicalcpu", &cores, &size, nil, 0) == 0 && cores > 0 {
+            return Int(cores)
+        }
+
+        return ProcessInfo.processInfo.activeProcessorCount
+    }
+
+    /// Get the vCPU count that was used at the last boot; or zero if we don't know it.
+    private func getLastCpuCount() -> Int {
+        return UserDefaults.standard.integer(forKey: "last_cpu_count")
+    }
+
+    /// Set the vCPU count that was used at the last boot.
+    private func setLastCpuCount(value: Int) {
+        UserDefaults.standard.set(value, forKey: "last_cpu_count")
+    }
+
+    /// Returns true iff the VM's virtual hardware has changed since the last boot; e.g. because we've been updated.
+    func machineRevisionChanged() -> Bool {
+        return UserDefaults.standard.integer(forKey: "last_machine_revision") != QEMUInterface.machineRevision
+    }
+
+    /// Returns true iff the VM we're about to boot should have our control channel. Our instant-boot snapshot was saved
+    /// from a machine without one; so it's left out when restoring that, and from the states we save afterwards,
+    /// until our next cold boot. The guest falls back to reaching us over TCP while it's missing.
+    private func controlChannelRequested(bootImageName: String?) -> Bool {
+        switch bootImageName {
+        case nil, "":
+            return true
+        case "instantboot":
+            return false
+        default:
+            return UserDefaults.standard.bool(forKey: "last_control_channel")
+        }
+    }
+
+    /// Returns true iff our next boot should give the guest a balloon. In "state_file" mode, guest RAM lives in our
+    /// shared memory file, which QEMU can't punch holes in on iOS; so pages the guest gives up would never make it
+    /// back to iOS. There, we leave the balloon out rather than have it quietly do nothing; Settings says as much.
+    private func balloonRequested() -> Bool {
+        return UserDefaults.standard.bool(forKey: "memory_balloon") && (getSnapshotMode() != "state_file")
+    }
+
+    /// Returns true iff the vCPU count has changed since the last boot.
+    func cpuCountChanged() -> Bool {
+        let lastCount = getLastCpuCount()
+
+        // Boots from before we tracked this always used four cores.
+        return getCpuCount() != ((lastCount == 0) ? 4 : lastCount)
+    }
+
+    /// Returns how we save the VM's state when we're backgrounded:
+    ///  - "state_file" keeps guest RAM in a memory file, and saves device state into our state file;
+    ///    so each save only writes the RAM that's changed since the last one.
+    ///  - "compressed_state" saves everything into our state file; skipping zero pages, compressing the rest
+    ///    across our cores, and decompressing it in parallel on resume.
+    ///  - "overlay_state" saves like "compressed_state", but also freezes the disk in an overlay layer;
+    ///    so the save stays good to resume from while the guest runs on, e.g. if we're killed later.
+    ///  - "savevm" saves everything into qcow snapshots, alternating between two of them.
+    private func getSnapshotMode() -> String {
+        return UserDefaults.standard.string(forKey: "snapshot_mode") ?? "state_file"
+    }
+
+    /// Returns the file that holds guest RAM, when we're using state-file saves.
+    private func getMemoryFileURL(diskName: String? = nil) -> URL {
+        let diskName = diskName ?? getDiskName()
+        return getDatastoreURL("\(diskName)_memory", fileExtension: "ram")
+    }
+
+    /// Returns the file that holds our saved device state, when we're using state-file saves.
+    private func getStateFileURL(diskName: String? = nil) -> URL {
+        let diskName = diskName ?? getDiskName()
+        return getDatastoreURL("\(diskName)_state", fileExtension: "vmstate")
+    }
+
+    /// Returns the socket we move VM state to and from QEMU over.
+    private func getMigrationSocketPath() -> String {
+        return getDatastoreURL("migration", fileExtension: "socket").path
+    }
+
+    /// Returns true iff our state file (and memory file) hold a complete, consistent state to resume from
+    /// in our current snapshot mode.
+    private func canResumeFromStateFile() -> Bool {
+        let diskName = getDiskName()
+        let mode = getSnapshotMode()
+
+        let valid = isStateFileValid()
+        let savedMode = getImageProperty(diskName: diskName, property: "state_file_mode", defaultValue: "state_file")
+
+        return valid && (savedMode == mode)
+            && FileManager.default.fileExists(atPath: getStateFileURL().path)
+            && ((mode != "state_file") || FileManager.default.fileExists(atPath: getMemoryFileURL().path))
+            && ((mode != "overlay_state") || FileManager.default.fileExists(atPath: getDiskLayerURL(getResumeLayer()).path))
+    }
+
+    /// Returns true iff our state file is marked as one we can resume from.
+    private func isStateFileValid() -> Bool {
+        return getImageProperty(diskName: getDiskName(), property: "state_file_valid", defaultValue: "false") == "true"
+    }
+
+    /// Marks whether our state file is one we can resume from.
+    private func setStateFileValid(_ valid: Bool) {
+        setImageProperty(diskName: getDiskName(), property: "state_file_valid", value: valid ? "true" : "false")
+    }
+
+    /// Sets up guest RAM for our state-file mode; and, if we're resuming, has QEMU restore our saved state.
+    private func configureStateFiles(config: OpaquePointer?, memoryValue: String, resume: Bool) {
+        let memoryFile = getMemoryFileURL()
+        let keepRamInFile = (activeSnapshotMode == "state_file")
+
+        // If we're not resuming from it, our memory file's contents are stale; start from an empty one,
+        // rather than having the guest fault old RAM in from storage.
+        if !resume || !keepRamInFile {
+            try? FileManager.default.removeItem(at: memoryFile)
+        }
+        if keepRamInFile {
+            qemu_launch_config_set_memory_file(config, memoryFile.path, memoryValue)
+        }
+
+        if resume {
+            qemu_launch_config_set_incoming_state(config, getStateFileURL().path, getMigrationSocketPath())
+
+            // Load with the same capabilities we saved with; and decompress across as many threads as we compress with.
+            // We also have QEMU tell us once it's done loading, so we don't have to keep asking.
+            qemu_launch_config_add_option(config, "-global", "migration.x-events=on")
+            for capability in QEMUInterface.stateFileCapabilities[activeSnapshotMode] ?? [] {
+                qemu_launch_config_add_option(config, "-global", "migration.\(capability.property)=on")
+            }
+            if !keepRamInFile {
+                qemu_launch_config_add_option(config, "-global",
+                                              "migration.x-decompress-threads=\(QEMUInterface.getSnapshotThreadCount())")
+            }
+
+            // In overlay mode, the guest needs a fresh disk layer before it runs; so have QEMU wait for us to
+            // set that up. Otherwise, once the guest runs, it'll no longer match our saved state.
+            if activeSnapshotMode == "overlay_state" {
+                qemu_launch_config_add_option(config, "-S", nil)
+            } else {
+                setStateFileValid(false)
+            }
+        }
+
+        // If we're booting some other way, the disk is about to move on without our saved state.
+        else {
+            setStateFileValid(false)
+        }
+    }
+
+    /// Removes any state-file save data; e.g. because we've switched to qcow snapshots, and it'd only be taking up space.
+    private func removeStateFiles() {
+        try? FileManager.default.removeItem(at: getMemoryFileURL())
+        try? FileManager.default.removeItem(at: getStateFileURL())
+        setStateFileValid(false)
+    }
+
     /// Returns the URL to a qcow image that will acts as our persistent store.
     private func getPersistentStore() -> URL
     {
@@ -358,18 +2023,312 @@ public class QEMUInterface {
         // Figure out where our persistent store would be located.
         let targetURL = getDatastoreURL(diskName, fileExtension: "qcow")
 
-        // If it doesn't exist, create a new copy based on our empty disk.
+        // If it doesn't exist, create a new disk based on our empty disk...
         if !FileManager.default.fileExists(atPath: targetURL.path) {
-            let emptyDiskURL = Bundle.main.url(forResource: "empty", withExtension: "qcow")
-            try! FileManager.default.copyItem(at: emptyDiskURL!, to: targetURL)
+            let emptyDiskURL = getBaseImageURL()
+
+            // ... either as a thin disk, which starts out empty and reads everything else from our base image;
+            // so it's instant to create, and its first boot is a cold one ...
+            if (UserDefaults.standard.string(forKey: "new_disk_mode") == "thin")
+                && QEMUInterface.createThinDisk(diskURL: targetURL, baseURL: emptyDiskURL) {
+                setImageProperty(diskName: diskName, property: "base_image", value: QEMUInterface.baseImageName)
+                setResumeImage(tag: "")
+            }
 
-            // Reset the startup to base instant-boot, since we now have a new disk.
-            setResumeImage(tag: "instantboot")
+            // ... or as a full copy; which we can reset to its base instant-boot, since we now have a new disk.
+            else {
+                try! FileManager.default.copyItem(at: emptyDiskURL, to: targetURL)
+                setImageProperty(diskName: diskName, property: "base_image", value: "")
+                setResumeImage(tag: "instantboot")
+            }
         }
     
         return targetURL
     }
 
+    /// Returns the location of the bundled image new disks are based on.
+    private func getBaseImageURL() -> URL {
+        return Bundle.main.resourceURL!.appendingPathComponent(QEMUInterface.baseImageName)
+    }
+
+    /// Returns the base image our disk reads anything it hasn't written itself from; or nil if it's not a thin disk.
+    private func getThinDiskBase() -> URL? {
+        let baseImage = getImageProperty(diskName: getDiskName(), property: "base_image", defaultValue: "")
+        return baseImage.isEmpty ? nil : Bundle.main.resourceURL!.appendingPathComponent(baseImage)
+    }
+
+    /// Replaces our thin disk with a fresh one; e.g. for a clean boot. Everything written to the disk is lost.
+    private func resetThinDisk() {
+        removeDiskLayers(getDiskLayers())
+        setDiskLayers([])
+        setResumeLayer(nil)
+
+        try? FileManager.default.removeItem(at: getPersistentStore())
+        _ = getPersistentStore()
+    }
+
+    /// Replaces our fully-copied disk with a fresh copy of our base image; e.g. for a clean boot that can't revert it
+    /// by loading its instant-boot snapshot. Everything written to the disk is lost.
+    private func resetCopiedDisk() {
+        removeDiskLayers(getDiskLayers())
+        setDiskLayers([])
+        setResumeLayer(nil)
+
+        let diskURL = getPersistentStore()
+        try? FileManager.default.removeItem(at: diskURL)
+        try! FileManager.default.copyItem(at: getBaseImageURL(), to: diskURL)
+        setResumeImage(tag: "instantboot")
+    }
+
+    /// Copies everything our thin disk reads from its base image into the disk itself, so it no longer depends on
+    /// the base. QEMU does this in the background, cluster by cluster, while the guest keeps running.
+    /// Returns nil once the copy has started, or a description of why it couldn't be.
+    func flattenDisk() -> String? {
+        guard getThinDiskBase() != nil else {
+            return "this disk doesn't have a base image"
+        }
+        guard let qmp = qmp else {
+            return "QEMU isn't running"
+        }
+
+        // Our disk image may be below the guest's own layer; so find it by the node QEMU opened it as.
+        let diskName = getDiskName()
+        let diskImage = getPersistentStore().lastPathComponent
+        guard case .success(let result) = qmp.executeAndWait("query-named-block-nodes"),
+              let nodes = result as? [[String: Any]],
+              let node = nodes.first(where: {
+                  ($0["drv"] as? String == "qcow2") && ($0["file"] as? String).map { URL(fileURLWithPath: $0).lastPathComponent } == diskImage
+              }),
+              let nodeName = node["node-name"] as? String else {
+            return "could not find our disk image in QEMU"
+        }
+
+        // Once the copy's complete, QEMU drops the disk's reference to its base; and so do we.
+        var subscriptions : [(event: String, token: UUID)] = []
+        let handler : QMPClient.EventHandler = { [weak self] event, data in
+            guard data["device"] as? String == QEMUInterface.diskFlattenJobId else {
+                return
+            }
+
+            if (event == "BLOCK_JOB_COMPLETED") && (data["error"] == nil) {
+                self?.setImageProperty(diskName: diskName, property: "base_image", value: "")
+            } else {
+                NSLog("flattening our disk didn't finish: \(data)")
+            }
+
+            for subscription in subscriptions {
+                qmp.unsubscribe(from: subscription.event, token: subscription.token)
+            }
+        }
+        subscriptions = ["BLOCK_JOB_COMPLETED", "BLOCK_JOB_CANCELLED"].map {
+            (event: $0, token: qmp.subscribe(to: $0, handler: handler))
+        }
+
+        let started = qmp.executeAndWait("block-stream", arguments: ["job-id": QEMUInterface.diskFlattenJobId, "device": nodeName])
+        guard case .success = started else {
+            for subscription in subscriptions {
+                qmp.unsubscribe(from: subscription.event, token: subscription.token)
+            }
+            return "QEMU could not start flattening our disk: \(started)"
+        }
+
+        return nil
+    }
+
+    /// Creates a qcow2 image that holds no data of its own, and reads everything from the given base image.
+    /// Returns false if the base couldn't be read, or the new image couldn't be written.
+    ///
+    /// The image is laid out as qemu-img would lay it out: the header and the base's path in the first cluster,
+    /// then a one-cluster refcount table, its one refcount block, and an empty L1 table.
+    private static func createThinDisk(diskURL: URL, baseURL: URL) -> Bool {
+        guard let diskSize = getVirtualDiskSize(diskURL: baseURL) else {
+            return false
+        }
+
+        let clusterSize = 1 << thinDiskClusterBits
+        let backingFile = Data(baseURL.path.utf8)
+        let backingFileOffset = 128
+
+        // Each L1 entry points to an L2 table, which maps a cluster's worth of 8-byte entries; and each cluster's
+        // refcount takes two bytes, in a refcount block that must count every cluster we create.
+        let bytesPerL2Table = UInt64(clusterSize / 8) << thinDiskClusterBits
+        let l1Size = Int((diskSize + bytesPerL2Table - 1) / bytesPerL2Table)
+        let l1Clusters = max(((l1Size * 8) + clusterSize - 1) / clusterSize, 1)
+        let clusterCount = 3 + l1Clusters
+
+        guard (backingFileOffset + backingFile.count <= clusterSize) && (clusterCount <= clusterSize / 2) else {
+            return false
+        }
+
+        var image = Data(count: clusterCount * clusterSize)
+        func put<T: FixedWidthInteger>(_ value: T, at offset: Int) {
+            withUnsafeBytes(of: value.bigEndian) { image.replaceSubrange(offset..<(offset + MemoryLayout<T>.size), with: $0) }
+        }
+
+        // Our header describes a version-3 image the same size as our base, with 16-bit refcounts...
+        put(UInt32(0x514649fb), at: 0)
+        put(UInt32(3), at: 4)
+        put(UInt64(backingFileOffset), at: 8)
+        put(UInt32(backingFile.count), at: 16)
+        put(UInt32(thinDiskClusterBits), at: 20)
+        put(diskSize, at: 24)
+        put(UInt32(l1Size), at: 36)
+        put(UInt64(3 * clusterSize), at: 40)
+        put(UInt64(clusterSize), at: 48)
+        put(UInt32(1), at: 56)
+        put(UInt32(4), at: 96)
+        put(UInt32(104), at: 100)
+
+        // ... followed by an extension noting that our base is qcow2 too, so QEMU doesn't have to probe it;
+        // the (zeroed) end of our extensions; and the path to our base.
+        put(UInt32(0xe2792aca), at: 104)
+        put(UInt32(5), at: 108)
+        image.replaceSubrange(112..<117, with: Data("qcow2".utf8))
+        image.replaceSubrange(backingFileOffset..<(backingFileOffset + backingFile.count), with: backingFile)
+
+        // Our refcount table points to our one refcount block, which counts each of our clusters once.
+        // Our L1 table stays empty; so every read falls through to our base.
+        put(UInt64(2 * clusterSize), at: clusterSize)
+        for cluster in 0..<clusterCount {
+            put(UInt16(1), at: (2 * clusterSize) + (cluster * 2))
+        }
+
+        return FileManager.default.createFile(atPath: diskURL.path, contents: image)
+    }
+
+    /// Points a thin disk at its base image's current location; which moves whenever the app is updated.
+    /// QEMU always writes the base's path last in an image's first cluster; so we can rewrite it in place.
+    private static func updateBackingFile(diskURL: URL, baseURL: URL) {
+        guard let handle = try? FileHandle(forUpdating: diskURL) else {
+            return
+        }
+        defer { try? handle.close() }
+
+        guard let header = try? handle.read(upToCount: 24), header.count == 24 else {
+            return
+        }
+        let offset = header[8..<16].reduce(UInt64(0)) { ($0 << 8) | UInt64($1) }
+        let length = header[16..<20].reduce(UInt32(0)) { ($0 << 8) | UInt32($1) }
+        let clusterBits = header[20..<24].reduce(UInt32(0)) { ($0 << 8) | UInt32($1) }
+
+        // Leave alone any disk that's since been flattened, or whose base path we couldn't fit.
+        let backingFile = Data(baseURL.path.utf8)
+        guard (offset != 0) && (9...21).contains(clusterBits)
+                && (offset + UInt64(backingFile.count) <= (UInt64(1) << clusterBits)) else {
+            return
+        }
+
+        try? handle.seek(toOffset: offset)
+        if (try? handle.read(upToCount: Int(length))) == backingFile {
+            return
+        }
+
+        NSLog("pointing thin disk at its base image, now at \(baseURL.path)")
+        try? handle.seek(toOffset: offset)
+        try? handle.write(contentsOf: backingFile)
+        try? handle.seek(toOffset: 16)
+        try? handle.write(contentsOf: withUnsafeBytes(of: UInt32(backingFile.count).bigEndian) { Data($0) })
+        try? handle.synchronize()
+    }
+
+
+    /// Returns the cache, AIO and qcow2 metadata-cache options to use for a disk.
+    ///
+    /// Each disk can override these via its image properties (e.g. with `tctictl lowlevel raw disk_option cache none`;
+    /// which is the only way to get "unsafe" caching, meant for scratch disks);
+    /// otherwise we use the global setting for the cache mode, thread-pool AIO, and an L2 cache large
+    /// enough to map the whole disk -- so random I/O across a large sparse disk doesn't thrash the cache.
+    private func getDiskOptions(diskURL: URL, diskName: String? = nil) -> [(String, String)] {
+        let diskName = diskName ?? getDiskName()
+
+        // The global setting covers the persistent disk; so it never gets "unsafe", which a jetsam kill could leave
+        // corrupted. Scratch disks can still opt into it with a per-disk override.
+        var cacheMode = UserDefaults.standard.string(forKey: "disk_cache_mode") ?? "writeback"
+        if cacheMode == "unsafe" {
+            cacheMode = "writeback"
+        }
+
+        let defaults : [String: String] = [
+            "cache": cacheMode,
+            "aio": "threads",
+            "l2-cache-size": String(QEMUInterface.getFullCoverageL2CacheSize(diskURL: diskURL)),
+            "cache-clean-interval": QEMUInterface.defaultCacheCleanInterval,
+        ]
+
+        var options : [(String, String)] = []
+        for key in QEMUInterface.diskOptionValues.keys.sorted() {
+            var value = getImageProperty(diskName: diskName, property: "disk_option_\(key)", defaultValue: defaults[key]!)
+
+            // io_uring only exists on Linux hosts; it's allowed for the sake of e.g. our host-side
+            // benchmarks, but here on Darwin we have to stick to the thread pool.
+            if key == "aio" && value == "io_uring" {
+                NSLog("io_uring is not available on this host; using thread-pool AIO")
+                value = "threads"
+            }
+
+            options.append((key, value))
+        }
+
+        return options
+    }
+
+    /// Sets a per-disk storage option for the current disk; takes effect on the next boot.
+    /// Returns false if the option or value isn't one we support.
+    func setDiskOption(key: String, value: String) -> Bool {
+        guard let allowedValues = QEMUInterface.diskOptionValues[key] else {
+            return false
+        }
+
+        // Check that our value makes sense for the option in question.
+        switch key {
+        case "l2-cache-size":
+            guard QEMUInterface.parseMemorySize(value) != nil else { return false }
+        case "cache-clean-interval":
+            guard UInt(value) != nil else { return false }
+        default:
+            guard allowedValues!.contains(value) else { return false }
+        }
+
+        setImageProperty(diskName: getDiskName(), property: "disk_option_\(key)", value: value)
+        return true
+    }
+
+    /// Returns the size of an L2 cache that maps every cluster of the given qcow2 image.
+    /// Each 8-byte L2 entry maps one cluster; so full coverage is (virtual size / cluster size) * 8 bytes.
+    private static func getFullCoverageL2CacheSize(diskURL: URL) -> UInt64 {
+        guard let (clusterBits, diskSize) = readQcowGeometry(diskURL: diskURL) else {
+            return maximumDefaultL2CacheSize
+        }
+
+        let fullCoverage = (diskSize >> clusterBits) * 8
+        return min(max(fullCoverage, 1 << 20), maximumDefaultL2CacheSize)
+    }
+
+    /// Returns the virtual size of a qcow2 image, in bytes; or nil if it can't be read.
+    private static func getVirtualDiskSize(diskURL: URL) -> UInt64? {
+        return readQcowGeometry(diskURL: diskURL)?.diskSize
+    }
+
+    /// Reads the cluster size (as a power of two) and virtual size of a qcow2 image; or returns nil if it can't.
+    private static func readQcowGeometry(diskURL: URL) -> (clusterBits: UInt32, diskSize: UInt64)? {
+        guard let handle = try? FileHandle(forReadingFrom: diskURL) else {
+            return nil
+        }
+        defer { try? handle.close() }
+
+        // The qcow2 header stores the cluster size's log2 at byte 20, and the virtual disk size at byte 24; both big-endian.
+        guard let header = try? handle.read(upToCount: 32), header.count == 32 else {
+            return nil
+        }
+        let clusterBits = header[20..<24].reduce(UInt32(0)) { ($0 << 8) | UInt32($1) }
+        let diskSize = header[24..<32].reduce(UInt64(0)) { ($0 << 8) | UInt64($1) }
+
+        guard (9...21).contains(clusterBits) else {
+            return nil
+        }
+
+        return (clusterBits, diskSize)
+    }
 
     /// Returns the URL of a folder that can be used as the root of our iOS mounts.
     /// Typically mounted as `/ios_host`.
@@ -483,27 +2442,29 @@ public class QEMUInterface {
         setImageProperty(diskName: diskName, property: "resume_image", value: tag)
     }
 
-    /// Issue a QEMU managament protocol scheme command.
-    private func issueMonitorCommand(_ command: String) {
-        let terminatedCommand = "\(command)\r\n"
-        
-        // Send our command ...
-        ensureMonitorConnection()
-        _ = try? monitorSocket?.write(from: terminatedCommand.data(using: .utf8)!)
+    /// Returns QEMU's statistics about its translated-code cache, as reported by `info jit`.
+    func getTranslationStatistics() -> String? {
+        return qmp?.humanMonitorCommand("info jit")
     }
 
-    /// Ensures we have a connection to our VM over the QEMU management protocol.
-    private func ensureMonitorConnection() {
-        
-        // If we already have a connection, we're done!
-        if let monitorSocket = monitorSocket {
-            if monitorSocket.isConnected {
-                return
+    /// Returns the number of times QEMU has had to flush its translated-code cache; or nil if unavailable.
+    /// A frequently-increasing count means our tb-size is too small for the guest's workload.
+    func getTBFlushCount() -> Int? {
+        guard let statistics = getTranslationStatistics() else {
+            return nil
+        }
+
+        for line in statistics.split(whereSeparator: \.isNewline) {
+            if line.contains("TB flush count") {
+                return line.split(separator: " ").last.flatMap { Int($0) }
             }
         }
-        
-        // Create a connection to QEMU via QMP.
-        monitorSocket = try! Socket.create(family: .unix, type: .stream, proto: .unix)
-        try! monitorSocket!.connect(to: monitorSocketPath!)
+
+        return nil
+    }
+
+    /// Drops our QMP connection; e.g. because the QEMU on the other end is going away.
+    private func disconnectMonitor() {
+        qmp?.disconnect()
     }
 }
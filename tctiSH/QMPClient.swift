@@ -0,0 +1,341 @@
+//
+//  QMPClient.swift
+//  Client for the QEMU Machine Protocol.
+//
+//  Created by Kate Temkin on 10/16/22.
+//  Copyright © 2022 Kate Temkin.
+//
+
+import Foundation
+import Socket
+
+/// Errors that can come back from a QMP command.
+enum QMPError : Error {
+
+    /// We couldn't reach QEMU; or lost our connection before it replied.
+    case disconnected
+
+    /// QEMU didn't reply in the time we were willing to wait.
+    case timedOut
+
+    /// QEMU ran the command, and reported an error.
+    case commandFailed(errorClass: String, description: String)
+}
+
+
+/// Small client for QEMU's JSON machine protocol.
+///
+/// Each command is tagged with an ID, so replies can be matched to their callers; which means
+/// commands can be pipelined, rather than each waiting on the last. QEMU's asynchronous events
+/// (e.g. STOP, RESUME, MIGRATION or JOB_STATUS_CHANGE) can be subscribed to by name.
+///
+/// Completions and event handlers run on the client's reader thread; so they should be quick,
+/// and must never wait on another QMP command themselves.
+class QMPClient {
+    typealias Completion = (Result<Any, QMPError>) -> Void
+    typealias EventHandler = (_ event: String, _ data: [String: Any]) -> Void
+
+    /// How long we'll wait for QEMU to greet us and accept our capabilities, when connecting.
+    private static let handshakeTimeout : TimeInterval = 5
+
+    /// The unix socket QEMU is serving QMP on.
+    private let socketPath : String
+
+    /// Our connection to QEMU, if we have one.
+    private var socket : Socket?
+
+    /// Protects all of our state below, and serializes our writes.
+    private let lock = NSLock()
+
+    /// Serializes our attempts to connect; which can take a while, so they're made without holding our lock.
+    private let connectLock = NSLock()
+
+    /// Commands that have been sent, but not yet answered; by command ID.
+    private var pendingCommands : [String: Completion] = [:]
+
+    /// Our event subscriptions, by event name.
+    private var eventHandlers : [String: [UUID: EventHandler]] = [:]
+
+    /// The ID to use for our next command.
+    private var nextCommandId = 0
+
+    init(socketPath: String) {
+        self.socketPath = socketPath
+    }
+
+
+    /// Issues a QMP command; calling `completion` (if provided) with its return value once it's done.
+    func execute(_ command: String, arguments: [String: Any]? = nil, completion: Completion? = nil) {
+        if send(command, arguments: arguments, completion: completion ?? { _ in }) == nil {
+            completion?(.failure(.disconnected))
+        }
+    }
+
+    /// Sends a command to QEMU, and files its completion away until the reply arrives.
+    /// Returns the command's ID; or nil if it couldn't be sent.
+    private func send(_ command: String, arguments: [String: Any]?, completion: @escaping Completion) -> String? {
+        guard let socket = connectIfNeeded() else {
+            return nil
+        }
+
+        lock.lock()
+        defer { lock.unlock() }
+
+        // If we lost the connection while we were getting hold of it, there's no one to send to.
+        guard self.socket === socket else {
+            return nil
+        }
+
+        // Tag the command, so we can match up its reply...
+        let commandId = "tctish-\(nextCommandId)"
+        nextCommandId += 1
+
+        var message : [String: Any] = ["execute": command, "id": commandId]
+        if let arguments = arguments {
+            message["arguments"] = arguments
+        }
+
+        // ... and send it on its way.
+        guard let data = try? JSONSerialization.data(withJSONObject: message),
+              (try? socket.write(from: data + "\n".data(using: .utf8)!)) != nil else {
+            return nil
+        }
+
+        pendingCommands[commandId] = completion
+        return commandId
+    }
+
+
+    /// Issues a QMP command, and waits for its result.
+    /// If we give up waiting, the command's reply is dropped whenever it arrives.
+    @discardableResult
+    func executeAndWait(_ command: String, arguments: [String: Any]? = nil, timeout: TimeInterval = 30) -> Result<Any, QMPError> {
+        let finished = DispatchSemaphore(value: 0)
+        let resultLock = NSLock()
+        var result : Result<Any, QMPError> = .failure(.timedOut)
+
+        // Our reader thread fills in the result; so it's only ever touched under its lock.
+        let commandId = send(command, arguments: arguments) { reply in
+            resultLock.lock()
+            result = reply
+            resultLock.unlock()
+            finished.signal()
+        }
+        guard let commandId = commandId else {
+            return .failure(.disconnected)
+        }
+
+        // If we time out, make sure nothing's left waiting to hand us a result we'll never read.
+        if finished.wait(timeout: .now() + timeout) == .timedOut {
+            lock.lock()
+            pendingCommands[commandId] = nil
+            lock.unlock()
+
+            return .failure(.timedOut)
+        }
+
+        resultLock.lock()
+        defer { resultLock.unlock() }
+        return result
+    }
+
+
+    /// Runs a human-monitor command over QMP, and returns its output; or nil if it couldn't be run.
+    /// Used for the handful of things (e.g. `savevm` and `hostfwd_add`) that QEMU 7.0 only offers via HMP.
+    func humanMonitorCommand(_ command: String, timeout: TimeInterval = 30) -> String? {
+        let result = executeAndWait("human-monitor-command", arguments: ["command-line": command], timeout: timeout)
+
+        guard case .success(let output) = result else {
+            return nil
+        }
+        return output as? String
+    }
+
+
+    /// Calls `handler` whenever QEMU reports the given event. Returns a token for unsubscribe().
+    @discardableResult
+    func subscribe(to event: String, handler: @escaping EventHandler) -> UUID {
+        let token = UUID()
+
+        lock.lock()
+        eventHandlers[event, default: [:]][token] = handler
+        lock.unlock()
+
+        return token
+    }
+
+
+    /// Removes a subscription made with subscribe().
+    func unsubscribe(from event: String, token: UUID) {
+        lock.lock()
+        eventHandlers[event]?[token] = nil
+        lock.unlock()
+    }
+
+
+    /// Drops our connection; e.g. because the QEMU on the other end is going away.
+    /// Any commands still waiting on a reply fail with `.disconnected`.
+    func disconnect() {
+        lock.lock()
+        let pending = dropConnection()
+        lock.unlock()
+
+        for completion in pending.values {
+            completion(.failure(.disconnected))
+        }
+    }
+
+
+    /// Connects to QEMU, if we're not already connected. Must be called without our lock held; our handshake
+    /// can take a while, and shouldn't hold up anyone who doesn't need a connection.
+    private func connectIfNeeded() -> Socket? {
+        connectLock.lock()
+        defer { connectLock.unlock() }
+
+        lock.lock()
+        if let socket = socket, socket.isConnected {
+            lock.unlock()
+            return socket
+        }
+        lock.unlock()
+
+        // Create a connection to QEMU...
+        guard let newSocket = try? Socket.create(family: .unix, type: .stream, proto: .unix),
+              (try? newSocket.connect(to: socketPath)) != nil else {
+            return nil
+        }
+
+        // ... and get through the QMP handshake: QEMU greets us, and we have to ask for command mode.
+        var buffer = Data()
+        guard readMessage(from: newSocket, buffer: &buffer)?["QMP"] != nil,
+              (try? newSocket.write(from: "{\"execute\": \"qmp_capabilities\"}\n")) != nil,
+              readMessage(from: newSocket, buffer: &buffer)?["return"] != nil else {
+            newSocket.close()
+            return nil
+        }
+
+        lock.lock()
+        socket = newSocket
+        lock.unlock()
+
+        // Once we're in command mode, everything else that comes in is handled by our reader; starting with anything
+        // that arrived along with QEMU's reply.
+        let reader = Thread { [weak self, buffer] in
+            self?.readMessages(from: newSocket, buffer: buffer)
+        }
+        reader.name = "QMP reader"
+        reader.start()
+
+        return newSocket
+    }
+
+
+    /// Tears down our connection, and returns any commands left waiting on it.
+    /// Must be called with our lock held.
+    private func dropConnection() -> [String: Completion] {
+        let pending = pendingCommands
+
+        socket?.close()
+        socket = nil
+        pendingCommands = [:]
+
+        return pending
+    }
+
+
+    /// Reads a single message during our handshake, before our reader thread takes over. Anything that arrives
+    /// after the message is left in `buffer`, for the next read.
+    private func readMessage(from socket: Socket, buffer: inout Data) -> [String: Any]? {
+        let deadline = Date().addingTimeInterval(QMPClient.handshakeTimeout)
+
+        while Date() < deadline {
+            if let newline = buffer.firstIndex(of: UInt8(ascii: "\n")) {
+                let line = buffer[buffer.startIndex..<newline]
+                buffer.removeSubrange(buffer.startIndex...newline)
+                return try? JSONSerialization.jsonObject(with: line) as? [String: Any]
+            }
+
+            // If the socket's broken, there's no point waiting out our timeout.
+            guard let status = try? socket.isReadableOrWritable(waitForever: false, timeout: 100) else {
+                return nil
+            }
+            guard status.readable else {
+                continue
+            }
+            guard let length = try? socket.read(into: &buffer), length > 0 else {
+                return nil
+            }
+        }
+
+        return nil
+    }
+
+
+    /// Body of our reader thread: splits QEMU's output into messages, and dispatches each one.
+    /// Starts with anything our handshake read past its last message.
+    private func readMessages(from socket: Socket, buffer initial: Data) {
+        var buffer = initial
+
+        while true {
+
+            // QMP sends exactly one JSON object per line.
+            while let newline = buffer.firstIndex(of: UInt8(ascii: "\n")) {
+                let line = buffer[buffer.startIndex..<newline]
+                buffer.removeSubrange(buffer.startIndex...newline)
+
+                if let message = try? JSONSerialization.jsonObject(with: line) as? [String: Any] {
+                    dispatch(message)
+                }
+            }
+
+            var chunk = Data()
+            guard let length = try? socket.read(into: &chunk), length > 0 else {
+                break
+            }
+            buffer.append(chunk)
+        }
+
+        // If this connection is still our current one, QEMU has gone away; fail anything still waiting on it.
+        lock.lock()
+        let pending = (self.socket === socket) ? dropConnection() : [:]
+        lock.unlock()
+
+        for completion in pending.values {
+            completion(.failure(.disconnected))
+        }
+    }
+
+
+    /// Hands a message from QEMU to whoever's waiting for it.
+    private func dispatch(_ message: [String: Any]) {
+
+        // Events go to their subscribers...
+        if let event = message["event"] as? String {
+            lock.lock()
+            let handlers = Array((eventHandlers[event] ?? [:]).values)
+            lock.unlock()
+
+            let data = message["data"] as? [String: Any] ?? [:]
+            for handler in handlers {
+                handler(event, data)
+            }
+            return
+        }
+
+        // ... and replies go to the command they answer.
+        guard let commandId = message["id"] as? String else {
+            return
+        }
+
+        lock.lock()
+        let completion = pendingCommands.removeValue(forKey: commandId)
+        lock.unlock()
+
+        if let error = message["error"] as? [String: Any] {
+            completion?(.failure(.commandFailed(errorClass: error["class"] as? String ?? "GenericError",
+                                                description: error["desc"] as? String ?? "")))
+        } else {
+            completion?(.success(message["return"] ?? [String: Any]()))
+        }
+    }
+}
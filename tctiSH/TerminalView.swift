@@ -86,6 +86,12 @@ public class TctiTermView: TerminalView, TerminalViewDelegate {
 
     /// Forces the SSH session to reconnect.
     func forceReconnect() {
+        recreateShell()
+        connect()
+    }
+
+    /// Creates a fresh SSH session, ready to be connected.
+    private func recreateShell() {
 
         // Force-recreate our SSH session...
         shell = try? SSHShell(sshLibrary: Libssh2.self,
@@ -96,11 +102,8 @@ public class TctiTermView: TerminalView, TerminalViewDelegate {
 
         shell?.log.enabled = TctiTermView.sshLoggingEnabled
 
-        // ... add a line-feed to ensure the cursor is in a valid drawing position, again...
+        // ... and add a line-feed to ensure the cursor is in a valid drawing position, again.
         self.feed(text: "\r\n")
-
-        // ... and reconnect.
-        connect()
     }
 
     /// Callback notified each time a setting is changed.
@@ -205,6 +208,10 @@ public class TctiTermView: TerminalView, TerminalViewDelegate {
                     self.connected = true
                     UserDefaults.standard.set(false, forKey: "attempting_boot")
 
+                    // Note our time-to-prompt, so slow launches can be tracked down.
+                    launch_trace_mark(LAUNCH_PHASE_FIRST_CONNECTION)
+                    NSLog("time to prompt: \(launch_trace_elapsed_ms(LAUNCH_PHASE_FIRST_CONNECTION))ms")
+
                     // Inform the SSH server of our new size, so it can resize its PTY.
                     let t = self.getTerminal()
                     _ = s.setTerminalSize(width: UInt (t.cols), height: UInt (t.rows))
@@ -239,6 +246,7 @@ public class TctiTermView: TerminalView, TerminalViewDelegate {
 
         // Pass through the size-change to our SSH session.
         _ = shell?.setTerminalSize(width: UInt(newCols), height: UInt(newRows))
+        HostEvent.terminalResized.post(value: "\(newCols)x\(newRows)")
     }
 
 
@@ -262,6 +270,8 @@ public class TctiTermView: TerminalView, TerminalViewDelegate {
 
             // ... and write the CWD into it.
             try? directory.write(to: cwdFile, atomically: true, encoding: .utf8)
+
+            HostEvent.cwdChanged.post(value: directory)
         }
 
     }
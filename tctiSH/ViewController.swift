@@ -100,6 +100,24 @@ class ViewController: UIViewController {
 
             tv.feed(text: "This will take ~20 seconds or so.\r\n\r\n")
 
+        }
+        // Likewise, if the number of CPUs has changed.
+        else if AppDelegate.cpuCountChanged {
+            tv.feed(text: "The number of CPUs given to tctiSH has changed.\r\n")
+            tv.feed(text: "We'll need to re-create our 'instant boot'\r\n")
+            tv.feed(text: "environment, just this once after the change.\r\n\r\n")
+
+            tv.feed(text: "This will take ~20 seconds or so.\r\n\r\n")
+
+        }
+        // Likewise, if an update has changed the VM's virtual hardware.
+        else if AppDelegate.machineRevisionChanged {
+            tv.feed(text: "tctiSH's virtual hardware has been updated.\r\n")
+            tv.feed(text: "We'll need to re-create our 'instant boot'\r\n")
+            tv.feed(text: "environment, just this once after the update.\r\n\r\n")
+
+            tv.feed(text: "This will take ~20 seconds or so.\r\n\r\n")
+
         } else {
             // Provide some filler content,to ensure the ScrollView starts with something in it;
             // and then issue a "clear", so it's off the backlog. This is a cheap, hackish way of
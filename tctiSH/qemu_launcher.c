@@ -10,162 +10,1496 @@
 //
 
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
+// The JIT hacks below are Darwin-specific; everything else is portable,
+// so the launcher can also be built on Linux (e.g. for utils/launcher_bench).
+#if defined(__APPLE__)
 #include <mach/mach.h>
 #include <mach-o/loader.h>
 #include <mach-o/getsect.h>
 #include <sys/fcntl.h>
 #include <sys/_types/_caddr_t.h>
+#endif
 
 #include "qemu_launcher.h"
 
-#define ARGUMENT_MAX (2048)
 #define PATH_MAX     (1024)
 
-// Helpers.
-#define ARRAY_SIZE(array) \
-    (sizeof(array) / sizeof(array[0]))
+// How we load the QEMU framework. Lazy binding defers resolving QEMU's imports until each is first
+// called, rather than resolving all of them up front; the hot paths are QEMU's own functions, which
+// don't go through lazy binding at all. Build with -DQEMU_DLOPEN_MODE=RTLD_NOW to compare.
+#ifndef QEMU_DLOPEN_MODE
+#define QEMU_DLOPEN_MODE (RTLD_LAZY)
+#endif
+
+#if defined(__APPLE__)
 
 // External functionality for JIT hacks.
 extern int csops(pid_t pid, unsigned int ops, void * useraddr, size_t usersize);
 extern boolean_t exc_server(mach_msg_header_t *, mach_msg_header_t *);
 extern int ptrace(int request, pid_t pid, caddr_t addr, int data);
 
-#define    CS_OPS_STATUS             0  /* return status */
-#define    CS_KILL          0x00000200  /* kill process if it becomes invalid */
-#define    CS_DEBUGGED      0x10000000  /* process is currently or has previously been debugged and allowed to run with invalid pages */
-#define    PT_TRACE_ME               0  /* child declares it's being traced */
-#define    PT_SIGEXC                12  /* signals as exceptions for current_proc */
+#define    CS_OPS_STATUS             0  /* return status */
+#define    CS_KILL          0x00000200  /* kill process if it becomes invalid */
+#define    CS_DEBUGGED      0x10000000  /* process is currently or has previously been debugged and allowed to run with invalid pages */
+#define    PT_TRACE_ME               0  /* child declares it's being traced */
+#define    PT_SIGEXC                12  /* signals as exceptions for current_proc */
+
+#endif
+
+
+//
+// QEMU internals that we'll use.
+//
+typedef void (*qemu_init_fn)(int argc, const char *argv[], const char *envp[]);
+typedef void (*qemu_main_loop_fn)(void);
+typedef void (*qemu_cleanup_fn)(void);
+
+// Run-state change notifications; used to spot the first time our vCPUs run.
+typedef void (*vm_change_state_handler_fn)(void *opaque, bool running, int state);
+typedef void *(*qemu_add_vm_change_state_handler_fn)(vm_change_state_handler_fn cb, void *opaque);
+
+// Requests that the main loop shut down; safe to call from other threads.
+typedef void (*qemu_system_shutdown_request_fn)(int reason);
+#define SHUTDOWN_CAUSE_HOST_UI (5)
+
+/// Minimum size of each block of arena storage.
+#define ARENA_CHUNK_SIZE (4096)
+
+/// A block of storage handed out by an arena.
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+/// A simple bump allocator. Nothing is freed individually; everything is released at once.
+/// Allocation failures are sticky: once one fails, so does everything built from the arena afterwards.
+struct arena {
+    struct arena_chunk *chunks;
+    bool failed;
+};
+
+/// A single option on QEMU's command line; e.g. `-device virtio-rng-pci`.
+struct qemu_option {
+    char *name;
+    char *value;
+};
+
+/// Describes a VM launch: which QEMU to run, and the options to run it with.
+/// The configuration, and everything it points to, lives in its own arena.
+struct qemu_launch_config {
+    struct arena arena;
+
+    char *qemu_image;
+    char *shared_folder_path;
+    char *boot_image_name;
+
+    // If set, we resume from a saved VM state file rather than booting; see qemu_launch_config_set_incoming_state().
+    char *incoming_state_path;
+    char *incoming_socket_path;
+
+    // The file backing guest RAM, if any; see qemu_launch_config_set_memory_file().
+    char *memory_file_path;
+
+    // Our options, in command-line order.
+    struct qemu_option *options;
+    size_t option_count;
+    size_t option_capacity;
+};
+
+/// State for the (single) QEMU instance this process runs.
+/// QEMU can only be brought up once per process; its options, QOM types and other global state stay registered
+/// after qemu_cleanup(). So once it's stopped, the process has to exit before QEMU can run again.
+struct qemu_launcher_state {
+    pthread_mutex_t lock;
+
+    // Held while loading our framework; so a launch waits for any pre-warm in progress.
+    pthread_mutex_t load_lock;
+
+    // True iff a pre-warm has started the trace for the upcoming launch.
+    bool prewarm_started_trace;
+
+    // Our loaded QEMU framework, and the entry points we use from it.
+    void *qemu_dll;
+    char *qemu_image;
+    qemu_init_fn qemu_init;
+    qemu_main_loop_fn qemu_main_loop;
+    qemu_cleanup_fn qemu_cleanup;
+    qemu_system_shutdown_request_fn qemu_system_shutdown_request;
+
+    // The thread running QEMU, if any; and whether we've ever started one.
+    pthread_t thread;
+    bool thread_running;
+    bool thread_launched;
+
+    // Zero iff the last run made it to QEMU's main loop and exited cleanly.
+    int exit_status;
+};
+
+static struct qemu_launcher_state launcher = {
+    .lock      = PTHREAD_MUTEX_INITIALIZER,
+    .load_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+//
+// Startup tracing.
+//
+
+/// The file, in our shared folder, that the guest can read our startup timings from.
+#define LAUNCH_TRACE_FILENAME "launch_timing.dat"
+
+/// Names for each of our startup phases, as written to our trace file.
+static const char *launch_phase_names[LAUNCH_PHASE_COUNT] = {
+    [LAUNCH_PHASE_START]            = "start",
+    [LAUNCH_PHASE_DLOPEN]           = "dlopen",
+    [LAUNCH_PHASE_SYMBOLS]          = "symbols",
+    [LAUNCH_PHASE_QEMU_START]       = "qemu_start",
+    [LAUNCH_PHASE_INIT]             = "qemu_init",
+    [LAUNCH_PHASE_FIRST_VCPU_RUN]   = "first_vcpu_run",
+    [LAUNCH_PHASE_FIRST_CONNECTION] = "first_connection",
+    [LAUNCH_PHASE_MEMORY_PREFETCHED] = "memory_prefetched",
+};
+
+/// Monotonic timestamps for each phase, in milliseconds; or zero if the phase hasn't happened.
+static double launch_phase_timestamps[LAUNCH_PHASE_COUNT];
+
+/// Where our trace file lives, once we know.
+static char launch_trace_path[PATH_MAX];
+
+/// Serializes access to our timestamps; which can be marked from QEMU's thread or the UI.
+static pthread_mutex_t launch_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/// Returns a monotonic timestamp, in milliseconds.
+static double monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000.0) + (now.tv_nsec / 1000000.0);
+}
+
+/// Writes out all phases recorded so far, relative to the start of launch.
+/// Must be called with the trace lock held.
+static void write_launch_trace(void) {
+    char temporary_path[PATH_MAX + 8];
+    FILE *trace;
+
+    if (launch_trace_path[0] == '\0') {
+        return;
+    }
+
+    // Write to a temporary file and then rename it, so the guest never sees a partial trace.
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", launch_trace_path);
+    trace = fopen(temporary_path, "w");
+    if (trace == NULL) {
+        return;
+    }
+
+    for (int phase = 0; phase < LAUNCH_PHASE_COUNT; ++phase) {
+        if (launch_phase_timestamps[phase] != 0) {
+            fprintf(trace, "%s %.3f\n", launch_phase_names[phase],
+                    launch_phase_timestamps[phase] - launch_phase_timestamps[LAUNCH_PHASE_START]);
+        }
+    }
+
+    fclose(trace);
+    rename(temporary_path, launch_trace_path);
+}
+
+/// Starts a new startup trace, clearing any previous one.
+static void start_launch_trace(const char *shared_folder_path) {
+    pthread_mutex_lock(&launch_trace_lock);
+
+    memset(launch_phase_timestamps, 0, sizeof(launch_phase_timestamps));
+    snprintf(launch_trace_path, sizeof(launch_trace_path), "%s/%s", shared_folder_path, LAUNCH_TRACE_FILENAME);
+
+    launch_phase_timestamps[LAUNCH_PHASE_START] = monotonic_ms();
+    write_launch_trace();
+
+    pthread_mutex_unlock(&launch_trace_lock);
+}
+
+/// Records the time at which a startup phase completed; only the first mark of a phase counts.
+void launch_trace_mark(enum launch_phase phase) {
+    if ((phase <= LAUNCH_PHASE_START) || (phase >= LAUNCH_PHASE_COUNT)) {
+        return;
+    }
+
+    pthread_mutex_lock(&launch_trace_lock);
+
+    // Only record phases for a launch that's actually in progress, and only once.
+    if ((launch_phase_timestamps[LAUNCH_PHASE_START] != 0) && (launch_phase_timestamps[phase] == 0)) {
+        launch_phase_timestamps[phase] = monotonic_ms();
+        write_launch_trace();
+    }
+
+    pthread_mutex_unlock(&launch_trace_lock);
+}
+
+/// Returns the time from launch until the given phase completed, in milliseconds; or -1 if it hasn't.
+double launch_trace_elapsed_ms(enum launch_phase phase) {
+    double elapsed = -1;
+
+    if ((phase < LAUNCH_PHASE_START) || (phase >= LAUNCH_PHASE_COUNT)) {
+        return elapsed;
+    }
+
+    pthread_mutex_lock(&launch_trace_lock);
+    if (launch_phase_timestamps[phase] != 0) {
+        elapsed = launch_phase_timestamps[phase] - launch_phase_timestamps[LAUNCH_PHASE_START];
+    }
+    pthread_mutex_unlock(&launch_trace_lock);
+
+    return elapsed;
+}
+
+//
+// Memory prefetch.
+//
+// When we resume with guest RAM in a memory file, nothing reads RAM up front: the vCPUs start
+// as soon as device state is loaded, and each page is faulted in from the file when the guest first
+// touches it. Once the guest is running, we also read the rest of the file into the page cache in
+// the background, so that later touches don't have to wait on storage either.
+//
+
+/// How much of the memory file we read at a time.
+#define MEMORY_PREFETCH_CHUNK_SIZE (4 * 1024 * 1024)
+
+/// The memory file to prefetch once the VM starts running; or NULL if there's none.
+static char *pending_memory_prefetch_path;
+static pthread_mutex_t memory_prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/// Thread that reads our memory file into the page cache, behind the running guest.
+static void *memory_prefetch_thread(void *raw_path) {
+    char *path = raw_path;
+    char *buffer = malloc(MEMORY_PREFETCH_CHUNK_SIZE);
+    off_t offset = 0, end;
+    ssize_t length;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if ((fd < 0) || (buffer == NULL)) {
+        goto done;
+    }
+
+    end = lseek(fd, 0, SEEK_END);
+    while (offset < end) {
+
+#if defined(SEEK_DATA)
+        // Skip any RAM the guest never touched; it's a hole in the file, and costs nothing to fault in.
+        offset = lseek(fd, offset, SEEK_DATA);
+        if (offset < 0) {
+            break;
+        }
+#endif
+
+        // Reading one chunk at a time keeps us from flooding storage ahead of the guest's own faults.
+        length = pread(fd, buffer, MEMORY_PREFETCH_CHUNK_SIZE, offset);
+        if (length <= 0) {
+            break;
+        }
+        offset += length;
+    }
+
+    launch_trace_mark(LAUNCH_PHASE_MEMORY_PREFETCHED);
+
+done:
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buffer);
+    free(path);
+
+    return NULL;
+}
+
+
+/// Arranges for the given memory file to be prefetched once the VM starts running; or, if NULL, for nothing to be.
+static void schedule_memory_prefetch(const char *memory_path) {
+    pthread_mutex_lock(&memory_prefetch_lock);
+    free(pending_memory_prefetch_path);
+    pending_memory_prefetch_path = memory_path ? strdup(memory_path) : NULL;
+    pthread_mutex_unlock(&memory_prefetch_lock);
+}
+
+
+/// Starts any prefetch scheduled by schedule_memory_prefetch().
+static void start_pending_memory_prefetch(void) {
+    pthread_attr_t qosAttribute;
+    pthread_t thread;
+    char *path;
+
+    pthread_mutex_lock(&memory_prefetch_lock);
+    path = pending_memory_prefetch_path;
+    pending_memory_prefetch_path = NULL;
+    pthread_mutex_unlock(&memory_prefetch_lock);
+
+    if (path == NULL) {
+        return;
+    }
+
+    // Run at a low priority; on iOS, this also throttles our reads behind the guest's.
+    pthread_attr_init(&qosAttribute);
+#if defined(__APPLE__)
+    pthread_attr_set_qos_class_np(&qosAttribute, QOS_CLASS_UTILITY, 0);
+#endif
+
+    if (pthread_create(&thread, &qosAttribute, memory_prefetch_thread, path) == 0) {
+        pthread_detach(thread);
+    } else {
+        free(path);
+    }
+
+    pthread_attr_destroy(&qosAttribute);
+}
+
+
+/// Run-state handler that notes the first time our vCPUs start running; and starts any memory prefetch.
+static void note_vm_state_change(void *opaque, bool running, int state) {
+    (void)opaque;
+    (void)state;
+
+    if (running) {
+        launch_trace_mark(LAUNCH_PHASE_FIRST_VCPU_RUN);
+        start_pending_memory_prefetch();
+    }
+}
+
+
+//
+// Launch configuration.
+//
+
+/// Allocates zeroed storage from an arena; or returns NULL if we're out of memory.
+static void *arena_alloc(struct arena *arena, size_t size) {
+    struct arena_chunk *chunk = arena->chunks;
+    void *allocation;
+
+    if (arena->failed) {
+        return NULL;
+    }
+
+    // Keep everything we hand out pointer-aligned.
+    size = (size + (sizeof(void *) - 1)) & ~(sizeof(void *) - 1);
+
+    // If our current chunk can't fit this allocation, grab a new one that can.
+    if ((chunk == NULL) || ((chunk->size - chunk->used) < size)) {
+        size_t chunk_size = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+
+        chunk = calloc(1, sizeof(struct arena_chunk) + chunk_size);
+        if (chunk == NULL) {
+            arena->failed = true;
+            return NULL;
+        }
+
+        chunk->size = chunk_size;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    allocation = chunk->data + chunk->used;
+    chunk->used += size;
+
+    return allocation;
+}
+
+/// Releases everything allocated from an arena, in one step.
+static void arena_release(struct arena *arena) {
+    struct arena_chunk *chunk = arena->chunks;
+
+    while (chunk) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    arena->chunks = NULL;
+}
+
+/// Allocates a string printed from a format; sized to fit, so nothing is ever truncated.
+static char *arena_printf(struct arena *arena, const char *format, ...) {
+    va_list arguments, sizing_arguments;
+    char *result;
+    int length;
+
+    // Our arguments may well be other arena strings; if any of those failed, they're NULL.
+    if (arena->failed) {
+        return NULL;
+    }
+
+    va_start(arguments, format);
+    va_copy(sizing_arguments, arguments);
+    length = vsnprintf(NULL, 0, format, sizing_arguments);
+    va_end(sizing_arguments);
+
+    result = arena_alloc(arena, length + 1);
+    if (result) {
+        vsnprintf(result, length + 1, format, arguments);
+    }
+    va_end(arguments);
+
+    return result;
+}
+
+/// Duplicates a string into an arena; passing through NULL.
+static char *arena_strdup(struct arena *arena, const char *string) {
+    size_t length;
+    char *result;
+
+    if (string == NULL) {
+        return NULL;
+    }
+
+    length = strlen(string);
+    result = arena_alloc(arena, length + 1);
+    if (result) {
+        memcpy(result, string, length + 1);
+    }
+
+    return result;
+}
+
+/// Copies a value (e.g. a path) into an arena, escaping it for use inside a comma-separated option.
+/// QEMU treats a doubled comma as a literal one.
+static char *arena_escape_property(struct arena *arena, const char *value) {
+    char *result = arena_alloc(arena, (strlen(value) * 2) + 1);
+    char *out = result;
+
+    if (result == NULL) {
+        return NULL;
+    }
+
+    for (const char *in = value; *in != '\0'; ++in) {
+        if (*in == ',') {
+            *out++ = ',';
+        }
+        *out++ = *in;
+    }
+
+    *out = '\0';
+    return result;
+}
+
+/// Returns the length of the comma-separated property starting at `property`.
+/// QEMU escapes literal commas by doubling them, so ",," doesn't end a property.
+static size_t property_length(const char *property) {
+    const char *end = property;
+
+    while (*end != '\0') {
+        if (end[0] == ',') {
+            if (end[1] != ',') {
+                break;
+            }
+            end += 1;
+        }
+        end += 1;
+    }
+
+    return end - property;
+}
+
+/// Returns true iff a comma-separated option value contains the exact property `name=value`.
+static bool option_has_property(const char *option_value, const char *name, const char *value) {
+    size_t name_length = strlen(name), value_length = strlen(value);
+    const char *property = option_value;
+
+    while (true) {
+        size_t length = property_length(property);
+
+        if ((length == name_length + 1 + value_length) && (strncmp(property, name, name_length) == 0) &&
+            (property[name_length] == '=') && (strncmp(property + name_length + 1, value, value_length) == 0)) {
+            return true;
+        }
+
+        if (property[length] == '\0') {
+            return false;
+        }
+        property += length + 1;
+    }
+}
+
+/// Returns a copy of an option value with any `key=...` properties replaced by `key=value`.
+static char *option_with_property(struct arena *arena, const char *option_value, const char *key, const char *value) {
+    size_t key_length = strlen(key);
+    const char *property = option_value;
+    char *result = arena_alloc(arena, strlen(option_value) + key_length + strlen(value) + 3);
+    char *out = result;
+
+    if (result == NULL) {
+        return NULL;
+    }
+
+    // Copy over every property that isn't the one we're replacing...
+    while (true) {
+        size_t length = property_length(property);
+        bool matches = (length > key_length) && (strncmp(property, key, key_length) == 0) && (property[key_length] == '=');
+
+        if (!matches && (length > 0)) {
+            if (out != result) {
+                *out++ = ',';
+            }
+            memcpy(out, property, length);
+            out += length;
+        }
+
+        if (property[length] == '\0') {
+            break;
+        }
+        property += length + 1;
+    }
+
+    // ... and then add our new value to the end.
+    sprintf(out, "%s%s=%s", (out != result) ? "," : "", key, value);
+    return result;
+}
+
+
+/// Creates an empty launch configuration for the given QEMU framework; or returns NULL if we're out of memory.
+/// Startup timings will be traced into the given shared folder.
+struct qemu_launch_config *qemu_launch_config_create(const char *qemu_path, const char *shared_folder_path) {
+    struct arena arena = { NULL, false };
+    struct qemu_launch_config *config = arena_alloc(&arena, sizeof(struct qemu_launch_config));
+
+    if (config == NULL) {
+        return NULL;
+    }
+
+    config->arena              = arena;
+    config->qemu_image         = arena_strdup(&config->arena, qemu_path);
+    config->shared_folder_path = arena_strdup(&config->arena, shared_folder_path);
+
+    return config;
+}
+
+
+/// Appends an option whose strings already live as long as the configuration.
+static void append_option(struct qemu_launch_config *config, const char *option, const char *value) {
+
+    // Grow our option list, if we need to. The old list stays in the arena until the config is freed;
+    // as we double each time, that's never more than the size of the final list.
+    if (config->option_count == config->option_capacity) {
+        struct qemu_option *options;
+
+        config->option_capacity = config->option_capacity ? (config->option_capacity * 2) : 32;
+        options = arena_alloc(&config->arena, config->option_capacity * sizeof(struct qemu_option));
+        if (options == NULL) {
+            config->option_capacity = config->option_count;
+            return;
+        }
+        if (config->option_count) {
+            memcpy(options, config->options, config->option_count * sizeof(struct qemu_option));
+        }
+        config->options = options;
+    }
+
+    config->options[config->option_count].name  = (char *)option;
+    config->options[config->option_count].value = (char *)value;
+    config->option_count += 1;
+}
+
+
+/// Appends an option to the QEMU command line. `value` may be NULL for options that take no argument.
+void qemu_launch_config_add_option(struct qemu_launch_config *config, const char *option, const char *value) {
+    if (config == NULL) {
+        return;
+    }
+
+    append_option(config, arena_strdup(&config->arena, option), arena_strdup(&config->arena, value));
+}
+
+
+/// Sets a `key=value` property on an existing option, replacing any value it already had.
+/// The option is found by name, and -- if `id` is non-NULL -- by its `id=` property.
+/// Returns false if no matching option exists.
+bool qemu_launch_config_set_property(struct qemu_launch_config *config, const char *option, const char *id,
+                                     const char *key, const char *value) {
+    if (config == NULL) {
+        return false;
+    }
+
+    for (size_t i = 0; i < config->option_count; ++i) {
+        struct qemu_option *candidate = &config->options[i];
+
+        if ((strcmp(candidate->name, option) != 0) || (candidate->value == NULL)) {
+            continue;
+        }
+        if (id && !option_has_property(candidate->value, "id", id)) {
+            continue;
+        }
+
+        candidate->value = option_with_property(&config->arena, candidate->value, key, value);
+        return candidate->value != NULL;
+    }
+
+    return false;
+}
+
+
+/// Sets the snapshot we'll resume from; or NULL to cold-boot.
+void qemu_launch_config_set_boot_image(struct qemu_launch_config *config, const char *boot_image_name) {
+    if (config == NULL) {
+        return;
+    }
+
+    config->boot_image_name = arena_strdup(&config->arena, boot_image_name);
+}
+
+
+/// Frees a launch configuration, and everything it owns.
+void qemu_launch_config_free(struct qemu_launch_config *config) {
+    struct arena arena;
+
+    if (config == NULL) {
+        return;
+    }
+
+    // The configuration lives inside its own arena; so grab the arena before releasing it.
+    arena = config->arena;
+    arena_release(&arena);
+}
+
+
+/// Creates the launch configuration tctiSH normally boots with.
+struct qemu_launch_config *qemu_launch_config_create_default(const char *qemu_path,
+                                                             const char *kernel_path,
+                                                             const char *initrd_path,
+                                                             const char *bios_path,
+                                                             const char *disk_path,
+                                                             const char *shared_folder_path,
+                                                             const char *boot_image_name,
+                                                             const char *memory_value,
+                                                             const char *monitor_socket_path,
+                                                             int cpu_count,
+                                                             bool multithreaded_tcg,
+                                                             bool is_jit)
+{
+    struct qemu_launch_config *config = qemu_launch_config_create(qemu_path, shared_folder_path);
+    struct arena *arena;
+
+    if (config == NULL) {
+        return NULL;
+    }
+    arena = &config->arena;
+
+    // Tell QEMU where any option ROMS it might want are hiding.
+    qemu_launch_config_add_option(config, "-L", bios_path);
+
+    // We're a terminal; we don't display anything.
+    qemu_launch_config_add_option(config, "-display", "none");
+
+    // Guest memory.
+    qemu_launch_config_add_option(config, "-m", memory_value);
+
+    // Networking.
+    //
+    // Debug note: one can remove the 127.0.0.1 from the below string to make SSH'ing the VM possible
+    // from the debug host. This isn't recommended for debug builds.
+    qemu_launch_config_add_option(config, "-device", "virtio-net-pci,id=net1,netdev=net0");
+    qemu_launch_config_add_option(config, "-netdev", "user,id=net0,net=192.168.100.0/24,dhcpstart=192.168.100.100,hostfwd=tcp:127.0.0.1:10022-:22");
+
+    // Provide our host RNG to our guest; to speed up entropy generation.
+    qemu_launch_config_add_option(config, "-device", "virtio-rng-pci");
+
+    // Provide the disk we'll be working with.
+    qemu_launch_config_add_option(config, "-device", "virtio-blk-pci,id=disk1,drive=drive1");
+    append_option(config, "-drive",
+                  arena_printf(arena, "media=disk,id=drive1,if=none,file=%s,discard=unmap,detect-zeroes=unmap",
+                               arena_escape_property(arena, disk_path)));
+
+    // Select our kernel and ramdisk.
+    qemu_launch_config_add_option(config, "-kernel", kernel_path);
+    qemu_launch_config_add_option(config, "-initrd", initrd_path);
+
+    // Kernel command line; tells our image how to handle disk images.
+    // This variant selects the provided qcow disk file.
+    qemu_launch_config_add_option(config, "-append", "tcti_disk=file");
+
+    // Provide our guest with as many cores as we've been asked for.
+    append_option(config, "-smp", arena_printf(arena, "cpus=%d", (cpu_count > 0) ? cpu_count : 1));
+
+    // Machine-protocol (QMP) conection for tctiSH.
+    append_option(config, "-qmp", arena_printf(arena, "unix:%s,server,nowait", arena_escape_property(arena, monitor_socket_path)));
+
+    // Monitor conection in-guest tools.
+    qemu_launch_config_add_option(config, "-monitor", "tcp:localhost:10045,server,wait=off");
+
+    // Use JIT if we have JIT hacks; and select our TCG threading mode. We always specify
+    // a thread mode, as QEMU's default differs between hosts and we don't want to depend on it.
+    qemu_launch_config_add_option(config, "-accel", "tcg");
+    if (is_jit) {
+        qemu_launch_config_set_property(config, "-accel", NULL, "split-wx", "on");
+    }
+    qemu_launch_config_set_property(config, "-accel", NULL, "thread", multithreaded_tcg ? "multi" : "single");
+
+    // Share in our core shared folder, always.
+    append_option(config, "-fsdev", arena_printf(arena, "local,path=%s,security_model=none,id=fsdev0",
+                                                   arena_escape_property(arena, shared_folder_path)));
+    qemu_launch_config_add_option(config, "-device", "virtio-9p-pci,fsdev=fsdev0,mount_tag=shared");
+
+    // Finally, pick what we're booting from.
+    qemu_launch_config_set_boot_image(config, boot_image_name);
+
+    return config;
+}
+
+
+/// Configures how our persistent disk's I/O is handled.
+///
+/// With `use_iothread`, the disk is serviced by its own iothread rather than QEMU's main loop,
+/// which keeps heavy storage I/O from delaying networking (and thus our terminal) and monitor
+/// traffic. `queue_count` sets the number of virtqueues; one per vCPU lets each vCPU submit
+/// requests without contending with the others.
+void qemu_launch_config_set_disk_io(struct qemu_launch_config *config, bool use_iothread, int queue_count) {
+    if (config == NULL) {
+        return;
+    }
+
+    if (use_iothread) {
+        qemu_launch_config_add_option(config, "-object", "iothread,id=diskio0");
+        qemu_launch_config_set_property(config, "-device", "disk1", "iothread", "diskio0");
+    }
+
+    if (queue_count > 0) {
+        qemu_launch_config_set_property(config, "-device", "disk1", "num-queues",
+                                        arena_printf(&config->arena, "%d", queue_count));
+    }
+}
+
+
+/// Adds a virtio balloon, as "balloon0".
+///
+/// Guest RAM stays the size given by -m, so saved states remain loadable; but inflating the balloon takes
+/// pages away from the guest, and QEMU discards them, giving the memory back to iOS. With free page reporting,
+/// the guest also returns pages it's freed on its own; and with deflate-on-oom, a guest that runs short takes
+/// pages back out of the balloon rather than killing processes. Free page hinting has the guest tell QEMU which
+/// of its pages are free whenever a migration-based state save starts (though not a savevm), so the save can skip
+/// them; QEMU collects those hints on an iothread of their own. The saved-state sizes in our snapshot stats show
+/// what this and our pre-save trimming actually save.
+void qemu_launch_config_add_balloon(struct qemu_launch_config *config) {
+    if (config == NULL) {
+        return;
+    }
+
+    qemu_launch_config_add_option(config, "-object", "iothread,id=balloonio0");
+    qemu_launch_config_add_option(config, "-device",
+                                  "virtio-balloon-pci,id=balloon0,deflate-on-oom=on,free-page-reporting=on,"
+                                  "free-page-hint=on,iothread=balloonio0");
+}
+
+
+/// Adds a virtio-serial port for host<->guest control traffic, as "control0".
+///
+/// Our configuration protocol otherwise runs over TCP, through slirp and the guest's network stack; which costs
+/// each message a trip through emulated networking, and leaves it waiting on slirp's turn in QEMU's main loop.
+/// The serial port is just a pair of virtqueues. Its host end is a unix socket, which QEMU serves for us to
+/// connect to; it doesn't wait for us, since the guest only needs the channel once it's up.
+void qemu_launch_config_add_control_channel(struct qemu_launch_config *config, const char *socket_path) {
+    struct arena *arena;
+
+    if (config == NULL) {
+        return;
+    }
+    arena = &config->arena;
+
+    qemu_launch_config_add_option(config, "-device", "virtio-serial-pci,id=serial0");
+    append_option(config, "-chardev", arena_printf(arena, "socket,id=control0,path=%s,server=on,wait=off",
+                                                   arena_escape_property(arena, socket_path)));
+    qemu_launch_config_add_option(config, "-device", "virtserialport,bus=serial0.0,chardev=control0,name=org.tctish.control");
+}
+
+
+/// Backs guest RAM with a file that's shared with the host, rather than with anonymous memory.
+///
+/// Since the file always holds the guest's RAM, a state save with QEMU's x-ignore-shared capability
+/// only needs to write out device state; and getting the RAM itself onto flash just means writing
+/// back the pages dirtied since the last save (see qemu_sync_file()). The backend keeps QEMU's default
+/// "pc.ram" name, so internal snapshots taken without it can still be loaded.
+void qemu_launch_config_set_memory_file(struct qemu_launch_config *config, const char *memory_path, const char *memory_value) {
+    struct arena *arena;
+
+    if (config == NULL) {
+        return;
+    }
+    arena = &config->arena;
+
+    config->memory_file_path = arena_strdup(arena, memory_path);
+
+    append_option(config, "-object",
+                  arena_printf(arena, "memory-backend-file,id=pc.ram,size=%s,mem-path=%s,share=on",
+                               arena_escape_property(arena, memory_value),
+                               arena_escape_property(arena, memory_path)));
+    qemu_launch_config_add_option(config, "-machine", "memory-backend=pc.ram");
+}
+
+
+/// Resumes from a VM state file saved with the state sink below, rather than booting.
+///
+/// QEMU listens for a migration stream on the given unix socket; once it's up, we feed it the state file.
+/// The state must be loaded with the same migration capabilities it was saved with (e.g. with
+/// `-global migration.x-ignore-shared=on`); and if it was saved without its RAM, with the same memory file.
+/// Overrides any boot image.
+void qemu_launch_config_set_incoming_state(struct qemu_launch_config *config, const char *state_path, const char *socket_path) {
+    struct arena *arena;
+
+    if (config == NULL) {
+        return;
+    }
+    arena = &config->arena;
+
+    config->incoming_state_path  = arena_strdup(arena, state_path);
+    config->incoming_socket_path = arena_strdup(arena, socket_path);
+    config->boot_image_name      = NULL;
+
+    append_option(config, "-incoming", arena_printf(arena, "unix:%s", socket_path));
+}
+
+
+//
+// VM state transfer.
+//
+// QEMU 7.0 can only send its migration stream to a socket, a file descriptor, or a command; and we
+// can't run commands on iOS. So we move VM state between QEMU and files ourselves, over a unix socket.
+//
+
+/// Size of the buffer used to move state between QEMU and our files.
+#define STATE_TRANSFER_BUFFER_SIZE (1024 * 1024)
+
+/// How often our transfer threads check whether they've been cancelled.
+#define STATE_TRANSFER_POLL_MS     (50)
+
+/// How long we'll wait for QEMU to start listening for an incoming state.
+#define STATE_SOURCE_CONNECT_TIMEOUT_MS (30000)
+
+/// How long we'll wait for QEMU to finish a stream it's reported as complete.
+#define STATE_SINK_FINISH_TIMEOUT_MS    (5000)
+
+// Don't let QEMU hanging up on us raise SIGPIPE.
+#if defined(MSG_NOSIGNAL)
+#define STATE_SEND_FLAGS (MSG_NOSIGNAL)
+#else
+#define STATE_SEND_FLAGS (0)
+#endif
+
+/// A transfer of VM state from QEMU into a file.
+struct state_sink {
+    pthread_t thread;
+    bool running;
 
+    // Set to make the transfer give up; and set by the transfer once it's finished.
+    atomic_bool cancelled;
+    atomic_bool finished;
 
-//
-// QEMU internals that we'll use.
-//
-typedef void (*qemu_init_fn)(int argc, const char *argv[], const char *envp[]);
-typedef void (*qemu_main_loop_fn)(void);
-typedef void (*qemu_cleanup_fn)(void);
+    // True iff QEMU's whole stream was written out.
+    bool succeeded;
 
-// Structure for passing arguments to our QEMU thread.
-struct qemu_args {
-    char *qemu_image;
-    char *bios_dir;
-    char *kernel_filename;
-    char *initrd_filename;
-    char *disk_args;
-    char *shared_folder_args;
-    char *monitor_channel_args;
-    char *boot_image_name;
-    char *dll_name;
-    char *memory_value;
-    bool is_jit;
+    int listen_fd;
+    int file_fd;
+    char *socket_path;
+    char *state_path;
+    char *temporary_path;
 };
 
-/// Core thread that runs our background QEMU.
-static void* qemu_thread(void *raw_args) {
-    struct qemu_args *args = raw_args;
+static struct state_sink state_sink = {
+    .listen_fd = -1,
+    .file_fd   = -1,
+};
 
-    void *qemu_dll;
-    qemu_init_fn qemu_init;
-    qemu_main_loop_fn qemu_main_loop;
-    qemu_cleanup_fn qemu_cleanup;
+/// A transfer of VM state from a file into QEMU.
+struct state_source {
+    char *socket_path;
+    char *state_path;
+};
 
-    // Provide our QEMU command line and environment...
-    char *envp[] = { NULL };
-    char *argv[] = {
-        "qemu-system",
-        
-        // Tell QEMU where any option ROMS it might want are hiding.
-        "-L", args->bios_dir,
-        
-        // We're a terminal; we don't display anything.
-        "-display", "none",
-        
-        // Guest memory.
-        "-m", args->memory_value,
-        
-        // Networking.
-        //
-        // Debug note: one can remove the 127.0.0.1 from the above string to make SSH'ing the VM possible
-        // from the debug host. This isn't recommended for debug builds.
-        "-device", "virtio-net-pci,id=net1,netdev=net0",
-        "-netdev", "user,id=net0,net=192.168.100.0/24,dhcpstart=192.168.100.100,hostfwd=tcp:127.0.0.1:10022-:22",
-
-        // Provide our host RNG to our guest; to speed up entropy generation.
-        "-device", "virtio-rng-pci",
-        
-        // Provide the disk we'll be working with.
-        "-device", "virtio-blk-pci,id=disk1,drive=drive1",
-        "-drive", args->disk_args,
-        
-        // Select our kernel and ramdisk.
-        "-kernel", args->kernel_filename,
-        "-initrd", args->initrd_filename,
-        
-        // Kernel command line; tells our image how to handle disk images.
-        // This variant selects the provided qcow disk file.
-        "-append", "tcti_disk=file",
 
-        // Provide a few cores.
-        "-smp", "cpus=4",
-        
-        // Monitor conection for tctiSH.
-        "-monitor", args->monitor_channel_args,
-        
-        // Monitor conection in-guest tools.
-        "-monitor", "tcp:localhost:10045,server,wait=off",
+/// Fills in a unix socket address; returns false if the path doesn't fit.
+static bool unix_socket_address(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return false;
+    }
+
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+
+/// Keeps a socket from raising SIGPIPE on hosts that don't support MSG_NOSIGNAL.
+static void disable_sigpipe(int fd) {
+#if defined(SO_NOSIGPIPE)
+    int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable));
+#else
+    (void)fd;
+#endif
+}
+
+
+/// Waits for a file descriptor to become readable, giving up if the flag is set.
+/// Returns true iff the descriptor is readable.
+static bool wait_readable(int fd, atomic_bool *cancelled) {
+    struct pollfd poll_fd = { .fd = fd, .events = POLLIN };
+
+    while (!atomic_load(cancelled)) {
+        int result = poll(&poll_fd, 1, STATE_TRANSFER_POLL_MS);
+
+        if (result > 0) {
+            return true;
+        }
+        if ((result < 0) && (errno != EINTR)) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+
+/// Writes a whole buffer to a file descriptor; returns false on failure.
+static bool write_all(int fd, const char *buffer, size_t length, bool is_socket) {
+    while (length) {
+        ssize_t written = is_socket ? send(fd, buffer, length, STATE_SEND_FLAGS) : write(fd, buffer, length);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        buffer += written;
+        length -= (size_t)written;
+    }
+
+    return true;
+}
+
+
+/// Thread that accepts QEMU's migration stream, and writes it into our temporary state file.
+static void *state_sink_thread(void *unused) {
+    char *buffer = malloc(STATE_TRANSFER_BUFFER_SIZE);
+    int connection = -1;
+
+    (void)unused;
+    state_sink.succeeded = false;
+
+    if (buffer == NULL) {
+        goto done;
+    }
+
+    // Wait for QEMU to connect to us...
+    if (!wait_readable(state_sink.listen_fd, &state_sink.cancelled)) {
+        goto done;
+    }
+    connection = accept(state_sink.listen_fd, NULL, NULL);
+    if (connection < 0) {
+        goto done;
+    }
+
+    // ... and copy everything it sends until it hangs up.
+    while (wait_readable(connection, &state_sink.cancelled)) {
+        ssize_t length = read(connection, buffer, STATE_TRANSFER_BUFFER_SIZE);
+
+        if (length == 0) {
+            state_sink.succeeded = true;
+            break;
+        }
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (!write_all(state_sink.file_fd, buffer, (size_t)length, false)) {
+            fprintf(stderr, "failed to write VM state: %s\n", strerror(errno));
+            break;
+        }
+    }
+
+done:
+    if (connection >= 0) {
+        close(connection);
+    }
+    free(buffer);
+
+    atomic_store(&state_sink.finished, true);
+    return NULL;
+}
+
+
+/// Releases everything held by our state sink.
+static void state_sink_release(void) {
+    if (state_sink.listen_fd >= 0) {
+        close(state_sink.listen_fd);
+        unlink(state_sink.socket_path);
+    }
+    if (state_sink.file_fd >= 0) {
+        close(state_sink.file_fd);
+    }
+
+    free(state_sink.socket_path);
+    free(state_sink.state_path);
+    free(state_sink.temporary_path);
+
+    state_sink.listen_fd      = -1;
+    state_sink.file_fd        = -1;
+    state_sink.socket_path    = NULL;
+    state_sink.state_path     = NULL;
+    state_sink.temporary_path = NULL;
+    state_sink.running        = false;
+}
+
+
+/// Starts listening on the given unix socket for a migration stream (e.g. from `migrate -d unix:<path>`),
+/// which will be saved to the given file. The file is only replaced once qemu_state_sink_finish() commits it.
+bool qemu_state_sink_start(const char *socket_path, const char *state_path) {
+    struct sockaddr_un address;
+    size_t temporary_length;
+
+    if (state_sink.running || !unix_socket_address(socket_path, &address)) {
+        return false;
+    }
+
+    state_sink.socket_path = strdup(socket_path);
+    state_sink.state_path  = strdup(state_path);
+
+    temporary_length = strlen(state_path) + sizeof(".tmp");
+    state_sink.temporary_path = malloc(temporary_length);
+    snprintf(state_sink.temporary_path, temporary_length, "%s.tmp", state_path);
+
+    // Create the file we'll be writing into...
+    state_sink.file_fd = open(state_sink.temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (state_sink.file_fd < 0) {
+        fprintf(stderr, "failed to create VM state file: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    // ... and the socket QEMU will be writing to.
+    unlink(socket_path);
+    state_sink.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((state_sink.listen_fd < 0) ||
+        (bind(state_sink.listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0) ||
+        (listen(state_sink.listen_fd, 1) < 0)) {
+        fprintf(stderr, "failed to listen for VM state: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    atomic_store(&state_sink.cancelled, false);
+    atomic_store(&state_sink.finished, false);
+    if (pthread_create(&state_sink.thread, NULL, state_sink_thread, NULL) != 0) {
+        goto fail;
+    }
+
+    state_sink.running = true;
+    return true;
+
+fail:
+    if (state_sink.file_fd >= 0) {
+        unlink(state_sink.temporary_path);
+    }
+    state_sink_release();
+    return false;
+}
+
+
+/// Finishes a transfer started with qemu_state_sink_start().
+///
+/// If `commit` is set -- i.e. QEMU reported the migration as completed -- waits for the stream to end,
+/// and then atomically replaces the state file with what we received. Otherwise, throws the transfer away.
+/// Returns true iff the new state file was committed.
+bool qemu_state_sink_finish(bool commit) {
+    double deadline = monotonic_ms() + STATE_SINK_FINISH_TIMEOUT_MS;
+    bool committed = false;
+
+    if (!state_sink.running) {
+        return false;
+    }
+
+    // Give QEMU a moment to hang up on us, if it hasn't already; otherwise, stop waiting.
+    while (commit && !atomic_load(&state_sink.finished) && (monotonic_ms() < deadline)) {
+        usleep(STATE_TRANSFER_POLL_MS * 1000);
+    }
+    atomic_store(&state_sink.cancelled, true);
+    pthread_join(state_sink.thread, NULL);
+
+    // Only replace our last state once the new one is safely on disk.
+    if (commit && state_sink.succeeded && (fsync(state_sink.file_fd) == 0)) {
+        committed = (rename(state_sink.temporary_path, state_sink.state_path) == 0);
+    }
+    if (!committed) {
+        unlink(state_sink.temporary_path);
+    }
+
+    state_sink_release();
+    return committed;
+}
+
+
+/// Flushes a file's dirty pages -- including those written through QEMU's shared mapping -- to storage.
+bool qemu_sync_file(const char *path) {
+    int fd = open(path, O_RDONLY);
+    bool synced;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    synced = (fsync(fd) == 0);
+    close(fd);
+
+    return synced;
+}
+
+
+/// Thread that feeds a saved state file to QEMU, once it starts listening for it.
+static void *state_source_thread(void *raw_source) {
+    struct state_source *source = raw_source;
+    char *buffer = malloc(STATE_TRANSFER_BUFFER_SIZE);
+    double deadline = monotonic_ms() + STATE_SOURCE_CONNECT_TIMEOUT_MS;
+    struct sockaddr_un address;
+    int file_fd = -1, connection = -1;
+    ssize_t length;
+
+    if ((buffer == NULL) || !unix_socket_address(source->socket_path, &address)) {
+        goto done;
+    }
+
+    file_fd = open(source->state_path, O_RDONLY);
+    if (file_fd < 0) {
+        fprintf(stderr, "failed to open VM state file: %s\n", strerror(errno));
+        goto done;
+    }
+
+    // QEMU only starts listening partway through its init; so keep trying until it's there.
+    while (true) {
+        connection = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connection < 0) {
+            goto done;
+        }
+        if (connect(connection, (struct sockaddr *)&address, sizeof(address)) == 0) {
+            break;
+        }
+
+        close(connection);
+        connection = -1;
+
+        if (monotonic_ms() > deadline) {
+            fprintf(stderr, "timed out waiting for QEMU to accept our VM state\n");
+            goto done;
+        }
+        usleep(STATE_TRANSFER_POLL_MS * 1000);
+    }
+    disable_sigpipe(connection);
+
+    // Send QEMU everything we have; it'll take it from there.
+    while ((length = read(file_fd, buffer, STATE_TRANSFER_BUFFER_SIZE)) != 0) {
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (!write_all(connection, buffer, (size_t)length, true)) {
+            break;
+        }
+    }
+
+done:
+    if (connection >= 0) {
+        close(connection);
+    }
+    if (file_fd >= 0) {
+        close(file_fd);
+    }
+
+    free(buffer);
+    free(source->socket_path);
+    free(source->state_path);
+    free(source);
+
+    return NULL;
+}
+
+
+/// Starts feeding the given state file to QEMU over the given socket.
+static void start_state_source(const char *state_path, const char *socket_path) {
+    struct state_source *source = malloc(sizeof(*source));
+    pthread_t thread;
+
+    if (source == NULL) {
+        return;
+    }
+
+    source->state_path  = strdup(state_path);
+    source->socket_path = strdup(socket_path);
+
+    if (pthread_create(&thread, NULL, state_source_thread, source) == 0) {
+        pthread_detach(thread);
+    } else {
+        free(source->state_path);
+        free(source->socket_path);
+        free(source);
+    }
+}
 
-        // Use JIT if we have JIT hacks.
-        "-accel", args->is_jit ? "tcg,split-wx=on" : "tcg",
 
-        // Share in our core shared folder, always.
-        "-fsdev", args->shared_folder_args,
-        "-device", "virtio-9p-pci,fsdev=fsdev0,mount_tag=shared",
+/// Loads the given QEMU framework and resolves its entry points; or reuses it, if it's already loaded.
+/// Must be called with the load lock held. Returns false if the framework couldn't be used.
+static bool load_qemu_framework_locked(const char *qemu_image) {
+    qemu_add_vm_change_state_handler_fn qemu_add_vm_change_state_handler;
 
-        // These _must_ be last.
-        "-loadvm", args->boot_image_name
-    };
+    // If we already have this framework loaded, there's nothing to do.
+    // We can't swap in a different one, though; QEMU can't be safely unloaded.
+    if (launcher.qemu_dll) {
+        if (!launcher.qemu_init || (strcmp(launcher.qemu_image, qemu_image) != 0)) {
+            fprintf(stderr, "can't load %s; %s is already loaded\n", qemu_image, launcher.qemu_image);
+            return false;
+        }
 
-    int argc = ARRAY_SIZE(argv);
-    if (args->boot_image_name == NULL) {
-        argc -= 2;
+        launch_trace_mark(LAUNCH_PHASE_DLOPEN);
+        launch_trace_mark(LAUNCH_PHASE_SYMBOLS);
+        return true;
     }
 
     // Open the appropriate QEMU framework...
-    qemu_dll = dlopen(args->qemu_image, RTLD_NOW);
+    launcher.qemu_dll = dlopen(qemu_image, QEMU_DLOPEN_MODE);
+    if (launcher.qemu_dll == NULL) {
+        fprintf(stderr, "failed to load QEMU: %s\n", dlerror());
+        return false;
+    }
+    launcher.qemu_image = strdup(qemu_image);
+    launch_trace_mark(LAUNCH_PHASE_DLOPEN);
 
     // ... and fetch the QEMU functions we need.
-    qemu_init = dlsym(qemu_dll, "qemu_init");
-    qemu_main_loop = dlsym(qemu_dll, "qemu_main_loop");
-    qemu_cleanup = dlsym(qemu_dll, "qemu_cleanup");
+    launcher.qemu_init = dlsym(launcher.qemu_dll, "qemu_init");
+    launcher.qemu_main_loop = dlsym(launcher.qemu_dll, "qemu_main_loop");
+    launcher.qemu_cleanup = dlsym(launcher.qemu_dll, "qemu_cleanup");
+    launcher.qemu_system_shutdown_request = dlsym(launcher.qemu_dll, "qemu_system_shutdown_request");
+    qemu_add_vm_change_state_handler = dlsym(launcher.qemu_dll, "qemu_add_vm_change_state_handler");
+    if (!launcher.qemu_init || !launcher.qemu_main_loop || !launcher.qemu_cleanup) {
+        fprintf(stderr, "QEMU framework is missing its entry points: %s\n", dlerror());
+        launcher.qemu_init = NULL;
+        return false;
+    }
+    launch_trace_mark(LAUNCH_PHASE_SYMBOLS);
+
+    // Watch for our vCPUs starting, so we can tell guest boot apart from setup.
+    // This needs to be in place before qemu_init(), as that's where a normal boot starts the VM.
+    if (qemu_add_vm_change_state_handler) {
+        qemu_add_vm_change_state_handler(note_vm_state_change, NULL);
+    }
 
-    // Finally, run the lightweight VM.
+    return true;
+}
+
+
+/// Loads the given QEMU framework, waiting for any load already in progress; see load_qemu_framework_locked().
+static bool load_qemu_framework(const char *qemu_image) {
+    bool loaded;
+
+    pthread_mutex_lock(&launcher.load_lock);
+    loaded = load_qemu_framework_locked(qemu_image);
+    pthread_mutex_unlock(&launcher.load_lock);
+
+    return loaded;
+}
+
+
+/// Thread that loads our framework ahead of time.
+static void *prewarm_thread(void *raw_qemu_image) {
+    char *qemu_image = raw_qemu_image;
+
+    load_qemu_framework(qemu_image);
+    free(qemu_image);
+
+    return NULL;
+}
+
+
+/// Starts loading the QEMU framework in the background, so it's ready by the time we launch.
+void qemu_launcher_prewarm(const char *qemu_path, const char *shared_folder_path) {
+    pthread_attr_t qosAttribute;
+    pthread_t thread;
+
+    // Start our launch trace now, so the time we save shows up in our timings.
+    pthread_mutex_lock(&launcher.lock);
+    if (!launcher.thread_running) {
+        start_launch_trace(shared_folder_path);
+        launcher.prewarm_started_trace = true;
+    }
+    pthread_mutex_unlock(&launcher.lock);
+
+    pthread_attr_init(&qosAttribute);
+#if defined(__APPLE__)
+    pthread_attr_set_qos_class_np(&qosAttribute, QOS_CLASS_USER_INTERACTIVE, 0);
+#endif
+
+    if (pthread_create(&thread, &qosAttribute, prewarm_thread, strdup(qemu_path)) == 0) {
+        pthread_detach(thread);
+    }
+
+    pthread_attr_destroy(&qosAttribute);
+}
+
+
+/// Core thread that runs our background QEMU.
+static void* qemu_thread(void *raw_config) {
+    struct qemu_launch_config *config = raw_config;
+
+    // Provide our QEMU command line and environment...
+    char *envp[] = { NULL };
+    char **argv = arena_alloc(&config->arena, ((config->option_count * 2) + 4) * sizeof(char *));
+    int argc = 0;
+
+    if (argv == NULL) {
+        fprintf(stderr, "out of memory building QEMU's command line\n");
+        launcher.exit_status = -1;
+        goto cleanup;
+    }
+
+    argv[argc++] = "qemu-system";
+    for (size_t i = 0; i < config->option_count; ++i) {
+        argv[argc++] = config->options[i].name;
+        if (config->options[i].value) {
+            argv[argc++] = config->options[i].value;
+        }
+    }
+
+    // This _must_ be last.
+    if (config->boot_image_name) {
+        argv[argc++] = "-loadvm";
+        argv[argc++] = config->boot_image_name;
+    }
+
+    // Get ahold of QEMU...
+    if (!load_qemu_framework(config->qemu_image)) {
+        launcher.exit_status = -1;
+        goto cleanup;
+    }
+
+    // If we're resuming from a state file, QEMU will be waiting for us to hand it over; and any RAM
+    // in our memory file can be streamed in behind the guest, once it's running.
+    if (config->incoming_state_path) {
+        start_state_source(config->incoming_state_path, config->incoming_socket_path);
+    }
+    schedule_memory_prefetch(config->incoming_state_path ? config->memory_file_path : NULL);
+
+    // ... and run the lightweight VM until we're asked to stop.
+    launch_trace_mark(LAUNCH_PHASE_QEMU_START);
+    launcher.qemu_init(argc, (const char **)argv, (const char **)envp);
+    launch_trace_mark(LAUNCH_PHASE_INIT);
+
+    launcher.qemu_main_loop();
+    launcher.qemu_cleanup();
+    launcher.exit_status = 0;
+
+cleanup:
+    // Clean up the memory allcoated for this thread; our arguments all live in our config.
+    qemu_launch_config_free(config);
 
-    qemu_init(argc, (const char **)argv, (const char **)envp);
-    qemu_main_loop();
-    qemu_cleanup();
-    
-    // Clean up the memory allcoated for this thread.
-    free(args->bios_dir);
-    free(args->kernel_filename);
-    free(args->initrd_filename);
-    free(args->disk_args);
-    free(args->shared_folder_args);
-    free(args->memory_value);
-    if (args->boot_image_name) {
-        free(args->boot_image_name);
-    }
-    free(args);
-    
     return NULL;
 }
 
-/// Spawns a backgroudn thread that runs QEMU.
+
+/// Spawns a background thread that runs QEMU with the given configuration.
+/// Takes ownership of the configuration. Returns true iff QEMU was launched.
+bool run_background_qemu_with_config(struct qemu_launch_config *config)
+{
+    pthread_attr_t qosAttribute;
+    bool launched;
+
+    // A configuration we ran out of memory building is missing pieces; so it's not one we can run.
+    if ((config == NULL) || config->arena.failed) {
+        fprintf(stderr, "out of memory building our launch configuration; not launching QEMU\n");
+        qemu_launch_config_free(config);
+        return false;
+    }
+
+    pthread_mutex_lock(&launcher.lock);
+
+    // We only ever run one QEMU per process.
+    if (launcher.thread_launched) {
+        fprintf(stderr, "QEMU has already been launched in this process; not launching another\n");
+        qemu_launch_config_free(config);
+        pthread_mutex_unlock(&launcher.lock);
+        return false;
+    }
+
+    // Start timing our launch; everything we trace is relative to this point.
+    // If we were pre-warmed, we're already timing from the start of that.
+    if (!launcher.prewarm_started_trace) {
+        start_launch_trace(config->shared_folder_path);
+    }
+    launcher.prewarm_started_trace = false;
+
+    // Finally, spawn our thread.
+    pthread_attr_init(&qosAttribute);
+#if defined(__APPLE__)
+    pthread_attr_set_qos_class_np(&qosAttribute, QOS_CLASS_USER_INTERACTIVE, 0);
+#endif
+
+    launcher.thread_running = (pthread_create(&launcher.thread, &qosAttribute, qemu_thread, config) == 0);
+    launcher.thread_launched = launcher.thread_running;
+    if (!launcher.thread_running) {
+        qemu_launch_config_free(config);
+    }
+    launched = launcher.thread_running;
+
+    pthread_attr_destroy(&qosAttribute);
+    pthread_mutex_unlock(&launcher.lock);
+
+    return launched;
+}
+
+
+/// Asks QEMU to shut down, and waits for its thread to finish; which can take a while, so this shouldn't be
+/// called from the main thread. Returns zero if QEMU ran and exited cleanly; or -1 if it wasn't running or failed to start.
+int qemu_launcher_stop(void) {
+    int status;
+
+    pthread_mutex_lock(&launcher.lock);
+
+    if (!launcher.thread_running) {
+        pthread_mutex_unlock(&launcher.lock);
+        return -1;
+    }
+
+    // Ask the main loop to exit, as if the user had closed QEMU's window; this lets it clean up
+    // after itself (e.g. flushing our disk) rather than being torn down mid-write...
+    if (launcher.qemu_system_shutdown_request) {
+        launcher.qemu_system_shutdown_request(SHUTDOWN_CAUSE_HOST_UI);
+    }
+
+    // ... and wait for it to do so.
+    pthread_join(launcher.thread, NULL);
+    launcher.thread_running = false;
+    status = launcher.exit_status;
+
+    pthread_mutex_unlock(&launcher.lock);
+    return status;
+}
+
+
+/// Spawns a background thread that runs QEMU with our default configuration.
 void run_background_qemu(const char* qemu_path,
                          const char* kernel_path,
                          const char* initrd_path,
@@ -175,56 +1509,18 @@ void run_background_qemu(const char* qemu_path,
                          const char* boot_image_name,
                          const char* memory_value,
                          const char* monitor_socket_path,
+                         int cpu_count,
+                         bool multithreaded_tcg,
                          bool is_jit)
 {
-    pthread_t thread;
-    pthread_attr_t qosAttribute;
-    
-    struct qemu_args *args = calloc(1, sizeof(struct qemu_args));
-
-    args->is_jit             = is_jit;
-    args->qemu_image         = calloc(PATH_MAX, sizeof(char));
-    args->kernel_filename    = calloc(PATH_MAX, sizeof(char));
-    args->initrd_filename    = calloc(PATH_MAX, sizeof(char));
-    args->bios_dir           = calloc(PATH_MAX, sizeof(char));
-    args->memory_value       = calloc(PATH_MAX, sizeof(char));
-    if (boot_image_name) {
-        args->boot_image_name = calloc(PATH_MAX, sizeof(char));
-    }
-
-    // Create our disk argument.
-    args->disk_args  = calloc(ARGUMENT_MAX, sizeof(char));
-    snprintf(args->disk_args, ARGUMENT_MAX, "media=disk,id=drive1,if=none,file=%s,discard=unmap,detect-zeroes=unmap",
-             disk_path);
-
-    // Create our shared-folder argument.
-    args->shared_folder_args  = calloc(ARGUMENT_MAX, sizeof(char));
-    snprintf(args->shared_folder_args, ARGUMENT_MAX, "local,path=%s,security_model=none,id=fsdev0",
-             shared_folder_path);
-
-    // Create our monitor argument.
-    args->monitor_channel_args  = calloc(ARGUMENT_MAX, sizeof(char));
-    snprintf(args->monitor_channel_args, ARGUMENT_MAX, "unix:%s,server,nowait",
-             monitor_socket_path);
-
-    // Copy in each of our filenames/arguments.
-    strncpy(args->qemu_image, qemu_path, PATH_MAX - 1);
-    strncpy(args->kernel_filename, kernel_path, PATH_MAX - 1);
-    strncpy(args->initrd_filename, initrd_path, PATH_MAX - 1);
-    strncpy(args->bios_dir, bios_path, PATH_MAX - 1);
-    strncpy(args->memory_value, memory_value, PATH_MAX - 1);
-    if (boot_image_name) {
-        strncpy(args->boot_image_name, boot_image_name, PATH_MAX - 1);
-    }
-
-    // Finally, spawn our thread.
-    pthread_attr_init(&qosAttribute);
-    pthread_attr_set_qos_class_np(&qosAttribute, QOS_CLASS_USER_INTERACTIVE, 0);
-
-    pthread_create(&thread, &qosAttribute, qemu_thread, args);
-    pthread_detach(thread);
+    run_background_qemu_with_config(
+        qemu_launch_config_create_default(qemu_path, kernel_path, initrd_path, bios_path, disk_path,
+                                          shared_folder_path, boot_image_name, memory_value,
+                                          monitor_socket_path, cpu_count, multithreaded_tcg, is_jit));
 }
 
+#if defined(__APPLE__)
+
 /// Returns true iff the process has a debugger attached.
 /// (Method from UTM.)
 static bool has_debugger_attached(void) {
@@ -288,8 +1584,15 @@ static bool enable_ptrace_hack(void) {
     }
 }
 
+#endif
+
 bool set_up_jit(void) {
+#if defined(__APPLE__)
     // For now, we only have one JIT method, but later we should support
     // some e.g. jailbreak based methods.
     return enable_ptrace_hack();
+#else
+    // Off of Darwin, there's nothing to hack around; the host is free to JIT.
+    return false;
+#endif
 }
@@ -11,10 +11,118 @@
 
 #include <stdbool.h>
 
+/// Phases of VM startup, as recorded by the launcher.
+enum launch_phase {
+    LAUNCH_PHASE_START = 0,          ///< run_background_qemu() was called
+    LAUNCH_PHASE_DLOPEN,             ///< the QEMU framework finished loading
+    LAUNCH_PHASE_SYMBOLS,            ///< QEMU's entry points were resolved
+    LAUNCH_PHASE_QEMU_START,         ///< we called into qemu_init(), which restores any saved state
+    LAUNCH_PHASE_INIT,               ///< qemu_init() returned
+    LAUNCH_PHASE_FIRST_VCPU_RUN,     ///< the VM first entered the running state
+    LAUNCH_PHASE_FIRST_CONNECTION,   ///< the first connection came in over our SSH hostfwd
+    LAUNCH_PHASE_MEMORY_PREFETCHED,  ///< guest RAM was fully read back from our memory file, after a resume
+    LAUNCH_PHASE_COUNT
+};
+
+/// Records that a startup phase has completed. Later marks of the same phase are ignored.
+void launch_trace_mark(enum launch_phase phase);
+
+/// Returns the time from launch until the given phase, in milliseconds; or -1 if it hasn't happened yet.
+double launch_trace_elapsed_ms(enum launch_phase phase);
+
 /// Sets up an environment where we can JIT.
 bool set_up_jit(void);
 
-/// Runs QEMU in a background thread, providing our shell.
+/// An ordered set of QEMU command-line options, describing a single VM launch.
+struct qemu_launch_config;
+
+/// Creates an empty launch configuration for the given QEMU framework; or returns NULL if we're out of memory.
+/// Startup timings will be traced into the given shared folder.
+///
+/// The functions below accept a NULL configuration, and do nothing with it. If memory runs out while a configuration
+/// is being built, the configuration is marked as failed; and run_background_qemu_with_config() won't launch it.
+struct qemu_launch_config *qemu_launch_config_create(const char *qemu_path, const char *shared_folder_path);
+
+/// Creates the launch configuration tctiSH normally boots with; which can then be further customized.
+/// Returns NULL if we're out of memory.
+struct qemu_launch_config *qemu_launch_config_create_default(const char *qemu_path,
+                                                             const char *kernel_path,
+                                                             const char *initrd_path,
+                                                             const char *bios_path,
+                                                             const char *disk_path,
+                                                             const char *shared_folder_path,
+                                                             const char *boot_image_name,
+                                                             const char *memory_value,
+                                                             const char *monitor_socket_path,
+                                                             int cpu_count,
+                                                             bool multithreaded_tcg,
+                                                             bool is_jit);
+
+/// Appends an option (e.g. "-device") to the command line. `value` may be NULL for options without an argument.
+void qemu_launch_config_add_option(struct qemu_launch_config *config, const char *option, const char *value);
+
+/// Sets a `key=value` property on an existing option, replacing any previous value for that key.
+/// The option is matched by name, and -- if `id` is non-NULL -- by its `id=` property; e.g.
+/// ("-device", "disk1", "num-queues", "4") or ("-accel", NULL, "tb-size", "256").
+/// Returns false if no matching option exists.
+bool qemu_launch_config_set_property(struct qemu_launch_config *config, const char *option, const char *id,
+                                     const char *key, const char *value);
+
+/// Configures our persistent disk's I/O: optionally moving it onto a dedicated iothread,
+/// and setting its number of virtqueues (if `queue_count` is positive).
+void qemu_launch_config_set_disk_io(struct qemu_launch_config *config, bool use_iothread, int queue_count);
+
+/// Adds a memory balloon, through which the guest's usable memory can be shrunk (and grown back, up to its -m value)
+/// while it runs; and through which the guest hands pages it's freed back to the host, and tells state saves which
+/// pages they can skip.
+void qemu_launch_config_add_balloon(struct qemu_launch_config *config);
+
+/// Adds a paravirtual control channel: a virtio-serial port the guest sees as /dev/virtio-ports/org.tctish.control,
+/// whose host end is a unix socket QEMU listens on at the given path.
+void qemu_launch_config_add_control_channel(struct qemu_launch_config *config, const char *socket_path);
+
+/// Backs guest RAM with the given file, shared with the host, so that saving VM state doesn't require
+/// writing out all of RAM. `memory_value` must match the configuration's -m value.
+void qemu_launch_config_set_memory_file(struct qemu_launch_config *config, const char *memory_path, const char *memory_value);
+
+/// Resumes from a VM state file saved via qemu_state_sink_start(), fed to QEMU over the given unix socket,
+/// rather than booting. Requires the same migration capabilities, and memory file (if any), that the state
+/// was saved with. Overrides any boot image.
+void qemu_launch_config_set_incoming_state(struct qemu_launch_config *config, const char *state_path, const char *socket_path);
+
+/// Sets the snapshot to resume from; or NULL to cold-boot.
+void qemu_launch_config_set_boot_image(struct qemu_launch_config *config, const char *boot_image_name);
+
+/// Frees a launch configuration that won't be launched.
+void qemu_launch_config_free(struct qemu_launch_config *config);
+
+/// Listens on the given unix socket for a VM state migration stream (e.g. `migrate -d unix:<socket>`),
+/// to be saved into the given file. Only one transfer can be in progress at a time.
+bool qemu_state_sink_start(const char *socket_path, const char *state_path);
+
+/// Finishes a state transfer. If `commit` is set, waits for the stream to end and atomically replaces the
+/// state file with it; otherwise, discards it. Returns true iff a new state file was committed.
+bool qemu_state_sink_finish(bool commit);
+
+/// Flushes any dirty pages of the given file (e.g. our memory file) to storage. Returns true on success.
+bool qemu_sync_file(const char *path);
+
+/// Starts loading the given QEMU framework on a background thread, so it's ready by the time we launch.
+/// Launches of the same framework wait for the load to finish, and then reuse it. Startup tracing
+/// begins here, so our timings include the time that pre-warming saves.
+void qemu_launcher_prewarm(const char *qemu_path, const char *shared_folder_path);
+
+/// Runs QEMU in a background thread, using the given configuration.
+/// Takes ownership of the configuration. QEMU can only be launched once per process.
+/// Returns false if QEMU couldn't be launched; e.g. because we ran out of memory building its configuration.
+bool run_background_qemu_with_config(struct qemu_launch_config *config);
+
+/// Asks the running QEMU to shut down, and waits for it to exit; blocks, so call it off the main thread.
+/// QEMU can't be launched again afterwards; the process needs to exit first.
+/// Returns zero if QEMU exited cleanly; or -1 if it wasn't running or failed to start.
+int qemu_launcher_stop(void);
+
+/// Runs QEMU in a background thread with our default configuration, providing our shell.
 void run_background_qemu(const char *qemu_path,
                          const char *kernel_path,
                          const char *initrd_path,
@@ -24,6 +132,8 @@ void run_background_qemu(const char *qemu_path,
                          const char *boot_image_name,
                          const char *memory_value,
                          const char *monitor_socket_path,
+                         int cpu_count,
+                         bool multithreaded_tcg,
                          bool is_jit);
 
 #endif /* qemu_launcher_h */
@@ -0,0 +1,19 @@
+#!/bin/bash
+#
+# Builds the launcher benchmark against the app's own launcher source.
+#
+# The QEMU library itself is loaded at runtime; build one with e.g.:
+#    ../qemu-tcti/configure --target-list=x86_64-softmmu --enable-shared-lib
+#
+# Set e.g. CFLAGS=-DQEMU_DLOPEN_MODE=RTLD_NOW to compare framework loading modes.
+#
+
+set -e
+
+CC=${CC:-cc}
+LAUNCHER_DIR="../../tctiSH"
+
+$CC -O2 -Wall $CFLAGS -I$LAUNCHER_DIR \
+	-o launcher_bench \
+	launcher_bench.c $LAUNCHER_DIR/qemu_launcher.c \
+	-ldl -lpthread
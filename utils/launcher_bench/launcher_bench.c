@@ -0,0 +1,719 @@
+//
+// Linux-hosted driver for tctiSH's QEMU launcher.
+//
+// Runs the same launcher (and thus the same QEMU command line) that the app
+// uses, against a libqemu built with `--enable-shared-lib`, and measures how
+// long it takes for the guest's SSH server to answer on the forwarded port.
+//
+// Each run happens in a fresh child process, since QEMU can only be brought
+// up once per process.
+//
+//  Copyright (c) 2022 Kate Temkin.
+//
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qemu_launcher.h"
+
+/// The host port our launcher forwards to the guest's SSH server.
+#define SSH_FORWARD_PORT  (10022)
+
+/// How often we poke the forwarded port while waiting for the guest.
+#define POLL_INTERVAL_MS  (10)
+
+/// How long we'll wait for a single banner read before trying again.
+#define BANNER_TIMEOUT_MS (500)
+
+/// The launcher's TCP monitor; which we use to drive snapshot saves.
+#define MONITOR_PORT      (10045)
+
+/// The prompt the human monitor prints once it's finished responding to a command.
+#define MONITOR_PROMPT    "(qemu) "
+
+/// Where we save state in the state-file snapshot modes; and the snapshot tag we use for savevm.
+#define BENCH_STATE_PATH       "/tmp/tctish_bench.vmstate"
+#define BENCH_MIGRATION_SOCKET "/tmp/tctish_bench_migration.socket"
+#define BENCH_SNAPSHOT_TAG     "tctish_bench"
+
+/// The thread counts compared by --thread-sweep.
+static const int sweep_thread_counts[] = { 1, 2, 4, 8 };
+#define SWEEP_COUNT (sizeof(sweep_thread_counts) / sizeof(sweep_thread_counts[0]))
+
+/// How we save and restore state; mirrors QEMUInterface's snapshot modes.
+enum save_mode {
+    SAVE_NONE = 0,       ///< just measure boot
+    SAVE_SAVEVM,         ///< savevm into a qcow snapshot; resume with -loadvm
+    SAVE_STATE_FILE,     ///< RAM in a memory file, device state in a state file; resume with -incoming
+    SAVE_COMPRESSED,     ///< compressed RAM and device state in a state file; resume with -incoming
+};
+
+
+/// Everything needed to launch a single VM; mirrors QEMUInterface.startQemuThread().
+struct bench_options {
+    const char *qemu_library;
+    const char *kernel_path;
+    const char *initrd_path;
+    const char *bios_path;
+    const char *disk_path;
+    const char *shared_folder_path;
+    const char *boot_image_name;
+    const char *memory_value;
+    const char *monitor_socket_path;
+    int cpu_count;
+    bool single_threaded;
+    bool disk_iothread;
+    enum save_mode save_mode;
+    const char *memory_file_path;
+    int state_threads;
+    bool thread_sweep;
+    bool incoming;
+    const char *drive_options[16];
+    unsigned drive_option_count;
+    int prewarm_ms;
+    unsigned runs;
+    unsigned timeout_s;
+    bool verbose;
+};
+
+
+/// Returns a monotonic timestamp, in milliseconds.
+static double monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000.0) + (now.tv_nsec / 1000000.0);
+}
+
+
+/// Attempts to read an SSH banner from the forwarded port.
+/// Returns true iff the guest's SSH server identified itself.
+static bool ssh_banner_available(void) {
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(SSH_FORWARD_PORT),
+    };
+    struct timeval timeout = {
+        .tv_sec  = BANNER_TIMEOUT_MS / 1000,
+        .tv_usec = (BANNER_TIMEOUT_MS % 1000) * 1000,
+    };
+    char banner[64] = { 0 };
+    ssize_t length;
+    int sock;
+
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return false;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Slirp accepts connections on the host side as soon as the forward exists,
+    // even if nothing's listening in the guest -- so a connect alone proves nothing.
+    // Only count the guest as up once it's actually spoken SSH to us.
+    if (connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(sock);
+        return false;
+    }
+
+    length = recv(sock, banner, sizeof(banner) - 1, 0);
+    close(sock);
+
+    return (length >= 4) && (strncmp(banner, "SSH-", 4) == 0);
+}
+
+
+/// Opens a connection to the given local TCP port; returns the socket, or -1 on failure.
+static int connect_local(int port) {
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(port),
+    };
+    int sock;
+
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+
+/// Reads from the monitor until it prompts us again; returns false on failure.
+static bool read_until_prompt(int sock, char *response, size_t response_size) {
+    size_t length = 0;
+
+    response[0] = '\0';
+    while (!strstr(response, MONITOR_PROMPT)) {
+        ssize_t received = recv(sock, response + length, response_size - length - 1, 0);
+
+        if (received <= 0) {
+            return false;
+        }
+
+        length += (size_t)received;
+        response[length] = '\0';
+
+        // If the response doesn't fit, keep only its tail; which is where the prompt will be.
+        if (length > (response_size / 2)) {
+            memmove(response, response + length - (response_size / 4), (response_size / 4) + 1);
+            length = response_size / 4;
+        }
+    }
+
+    return true;
+}
+
+
+/// Runs a human monitor command, and waits for it to finish. The command's output is placed in
+/// `response`, if provided. Returns false if we couldn't talk to the monitor.
+static bool monitor_command(const char *command, char *response, size_t response_size) {
+    char scratch[4096];
+    bool succeeded = false;
+    int sock;
+
+    if (response == NULL) {
+        response = scratch;
+        response_size = sizeof(scratch);
+    }
+
+    sock = connect_local(MONITOR_PORT);
+    if (sock < 0) {
+        return false;
+    }
+
+    // Wait for the monitor's greeting, issue our command, and wait for it to finish.
+    if (read_until_prompt(sock, response, response_size) &&
+        (dprintf(sock, "%s\n", command) > 0) &&
+        read_until_prompt(sock, response, response_size)) {
+        succeeded = true;
+    }
+
+    close(sock);
+    return succeeded;
+}
+
+
+/// Returns the size of a file, in bytes; or the space it occupies on disk, if `allocated` is set.
+static double file_size(const char *path, bool allocated) {
+    struct stat info;
+
+    if (stat(path, &info) < 0) {
+        return 0;
+    }
+
+    return allocated ? (info.st_blocks * 512.0) : info.st_size;
+}
+
+
+/// Waits for an outgoing migration to finish, as QEMUInterface does; returns true iff it completed.
+static bool wait_for_migration(const struct bench_options *options) {
+    double deadline = monotonic_ms() + (options->timeout_s * 1000.0);
+    char response[4096];
+
+    while (monotonic_ms() < deadline) {
+        if (!monitor_command("info migrate", response, sizeof(response))) {
+            return false;
+        }
+        if (strstr(response, "Migration status: completed")) {
+            return true;
+        }
+        if (strstr(response, "Migration status: failed") || strstr(response, "Migration status: cancelled")) {
+            return false;
+        }
+
+        usleep(POLL_INTERVAL_MS * 1000);
+    }
+
+    return false;
+}
+
+
+/// Saves the running VM's state in the selected mode. Returns the time taken in milliseconds, or a
+/// negative value on failure; and the space the saved state takes up, in `size`.
+static double save_state(const struct bench_options *options, double *size) {
+    double disk_before = file_size(options->disk_path, true);
+    double start = monotonic_ms();
+    char command[256], response[4096];
+    bool saved;
+
+    if (options->save_mode == SAVE_SAVEVM) {
+
+        // savevm doesn't return control to the monitor until it's done.
+        saved = monitor_command("savevm " BENCH_SNAPSHOT_TAG, response, sizeof(response)) && !strstr(response, "Error");
+        *size = file_size(options->disk_path, true) - disk_before;
+
+    } else {
+        if (!qemu_state_sink_start(BENCH_MIGRATION_SOCKET, BENCH_STATE_PATH)) {
+            return -1;
+        }
+
+        if (options->save_mode == SAVE_STATE_FILE) {
+            monitor_command("migrate_set_capability x-ignore-shared on", NULL, 0);
+        } else {
+            monitor_command("migrate_set_capability compress on", NULL, 0);
+            snprintf(command, sizeof(command), "migrate_set_parameter compress-threads %d", options->state_threads);
+            monitor_command(command, NULL, 0);
+            monitor_command("migrate_set_parameter compress-level 1", NULL, 0);
+        }
+        monitor_command("migrate -d unix:" BENCH_MIGRATION_SOCKET, NULL, 0);
+
+        saved = qemu_state_sink_finish(wait_for_migration(options));
+        if (saved && (options->save_mode == SAVE_STATE_FILE)) {
+            saved = qemu_sync_file(options->memory_file_path);
+        }
+
+        // For memory-file saves, count the RAM the guest has actually touched.
+        *size = file_size(BENCH_STATE_PATH, false);
+        if (options->save_mode == SAVE_STATE_FILE) {
+            *size += file_size(options->memory_file_path, true);
+        }
+    }
+
+    return saved ? (monotonic_ms() - start) : -1;
+}
+
+
+/// Prints the per-phase timings the launcher recorded into our shared folder.
+static void print_launch_trace(const struct bench_options *options, double banner_ms) {
+    char path[1024], phase[64];
+    double elapsed, init_ms = -1;
+    FILE *trace;
+
+    snprintf(path, sizeof(path), "%s/launch_timing.dat", options->shared_folder_path);
+    trace = fopen(path, "r");
+    if (trace == NULL) {
+        return;
+    }
+
+    while (fscanf(trace, "%63s %lf", phase, &elapsed) == 2) {
+        printf("    %-16s %10.1f ms\n", phase, elapsed);
+        if (strcmp(phase, "qemu_init") == 0) {
+            init_ms = elapsed;
+        }
+    }
+    fclose(trace);
+
+    // The child starts its trace right after we fork it; so its timeline and ours line up closely.
+    if (init_ms >= 0) {
+        printf("    %-16s %10.1f ms\n", "init_to_banner", banner_ms - init_ms);
+    }
+}
+
+
+/// Body of each child process: launch QEMU exactly as the app would, and wait to be killed.
+static void run_child(const struct bench_options *options) {
+
+    // Keep QEMU's chatter out of our results, unless asked otherwise.
+    if (!options->verbose) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
+    }
+
+    // If asked, pre-warm the framework as the app does; and stand in for the app's own startup work.
+    if (options->prewarm_ms >= 0) {
+        qemu_launcher_prewarm(options->qemu_library, options->shared_folder_path);
+        usleep(options->prewarm_ms * 1000);
+    }
+
+    struct qemu_launch_config *config = qemu_launch_config_create_default(options->qemu_library,
+                                                                          options->kernel_path,
+                                                                          options->initrd_path,
+                                                                          options->bios_path,
+                                                                          options->disk_path,
+                                                                          options->shared_folder_path,
+                                                                          options->boot_image_name,
+                                                                          options->memory_value,
+                                                                          options->monitor_socket_path,
+                                                                          options->cpu_count,
+                                                                          !options->single_threaded,
+                                                                          false);
+
+    qemu_launch_config_set_disk_io(config, options->disk_iothread, options->cpu_count);
+
+    // Apply any disk options we're comparing; e.g. cache=none or aio=io_uring.
+    for (unsigned i = 0; i < options->drive_option_count; ++i) {
+        char key[64];
+        const char *value = strchr(options->drive_options[i], '=');
+        size_t key_length = value ? (size_t)(value - options->drive_options[i]) : 0;
+
+        if (!value || (key_length >= sizeof(key))) {
+            fprintf(stderr, "ignoring malformed drive option %s\n", options->drive_options[i]);
+            continue;
+        }
+
+        memcpy(key, options->drive_options[i], key_length);
+        key[key_length] = '\0';
+        qemu_launch_config_set_property(config, "-drive", "drive1", key, value + 1);
+    }
+
+    // Set up for the snapshot mode we're measuring, exactly as QEMUInterface does.
+    if (options->save_mode == SAVE_STATE_FILE) {
+        qemu_launch_config_set_memory_file(config, options->memory_file_path, options->memory_value);
+    }
+    if (options->incoming) {
+        char threads[64];
+
+        qemu_launch_config_set_incoming_state(config, BENCH_STATE_PATH, BENCH_MIGRATION_SOCKET);
+        if (options->save_mode == SAVE_STATE_FILE) {
+            qemu_launch_config_add_option(config, "-global", "migration.x-ignore-shared=on");
+        } else {
+            snprintf(threads, sizeof(threads), "migration.x-decompress-threads=%d", options->state_threads);
+            qemu_launch_config_add_option(config, "-global", "migration.x-compress=on");
+            qemu_launch_config_add_option(config, "-global", threads);
+        }
+    }
+
+    if (!run_background_qemu_with_config(config)) {
+        fprintf(stderr, "failed to launch QEMU\n");
+        exit(1);
+    }
+
+    // QEMU lives on its own thread; we just need to stay out of its way.
+    while (true) {
+        pause();
+    }
+}
+
+
+/// Performs a single boot; returns the time-to-banner in milliseconds, or a negative value on failure.
+/// If `save_ms` is provided, also saves the VM's state once it's up, reporting the time and space taken.
+static double run_once(const struct bench_options *options, double *save_ms, double *save_size) {
+    double start, now;
+    pid_t child;
+    int status;
+
+    start = monotonic_ms();
+
+    child = fork();
+    if (child < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (child == 0) {
+        run_child(options);
+        _exit(0);
+    }
+
+    // Poll until the guest answers, QEMU dies, or we run out of patience.
+    while (true) {
+        if (ssh_banner_available()) {
+            now = monotonic_ms();
+            break;
+        }
+
+        if (waitpid(child, &status, WNOHANG) == child) {
+            fprintf(stderr, "QEMU exited before the guest came up (status %d)\n", status);
+            return -1;
+        }
+
+        if ((monotonic_ms() - start) > (options->timeout_s * 1000.0)) {
+            fprintf(stderr, "timed out waiting for the guest after %us\n", options->timeout_s);
+            now = -1;
+            break;
+        }
+
+        usleep(POLL_INTERVAL_MS * 1000);
+    }
+
+    if (now >= 0) {
+        print_launch_trace(options, now - start);
+
+        if (save_ms) {
+            *save_ms = save_state(options, save_size);
+        }
+    }
+
+    // Tear down the VM; and make sure it's gone before the next run claims its ports.
+    kill(child, SIGKILL);
+    waitpid(child, &status, 0);
+    unlink(options->monitor_socket_path);
+
+    return (now < 0) ? -1 : (now - start);
+}
+
+
+/// Boots, saves the VM's state, and then resumes from it; printing how long each step took.
+/// Returns the resume time in milliseconds, or a negative value on failure; and the save time in `save_ms_out`,
+/// if provided.
+static double run_save_and_resume(const struct bench_options *options, double *save_ms_out) {
+    struct bench_options resume_options = *options;
+    double boot_ms, save_ms = -1, save_size = 0, resume_ms;
+
+    // Start from a clean slate; a stale memory file would make the first boot look slower.
+    if (options->save_mode == SAVE_STATE_FILE) {
+        unlink(options->memory_file_path);
+    }
+    unlink(BENCH_STATE_PATH);
+
+    boot_ms = run_once(options, &save_ms, &save_size);
+    if ((boot_ms < 0) || (save_ms < 0)) {
+        fprintf(stderr, "failed to save VM state\n");
+        return -1;
+    }
+    printf("  boot:   %10.1f ms\n", boot_ms);
+    printf("  save:   %10.1f ms  %10.1f MiB\n", save_ms, save_size / (1024.0 * 1024.0));
+    if (save_ms_out) {
+        *save_ms_out = save_ms;
+    }
+
+    // Resume from what we just saved.
+    if (options->save_mode == SAVE_SAVEVM) {
+        resume_options.boot_image_name = BENCH_SNAPSHOT_TAG;
+    } else {
+        resume_options.incoming = true;
+    }
+
+    resume_ms = run_once(&resume_options, NULL, NULL);
+    if (resume_ms >= 0) {
+        printf("  resume: %10.1f ms to SSH banner\n", resume_ms);
+    }
+
+    return resume_ms;
+}
+
+
+/// Converts a QEMU-style memory size (e.g. "512M" or "2G") into bytes; bare numbers are MiB, as in QEMU.
+static double parse_memory_size(const char *value) {
+    char *suffix;
+    double size = strtod(value, &suffix);
+
+    switch (*suffix) {
+        case 'K': case 'k': return size * 1024.0;
+        case 'G': case 'g': return size * 1024.0 * 1024.0 * 1024.0;
+        case 'T': case 't': return size * 1024.0 * 1024.0 * 1024.0 * 1024.0;
+        default:            return size * 1024.0 * 1024.0;
+    }
+}
+
+
+/// Saves and resumes once for each of our sweep's thread counts, and reports how quickly guest RAM moved
+/// through each; in MB/s of guest RAM, so runs with different compression ratios compare fairly.
+/// Returns the number of thread counts that failed.
+static int run_thread_sweep(const struct bench_options *options) {
+    double ram_mb = parse_memory_size(options->memory_value) / (1000.0 * 1000.0);
+    double save_ms[SWEEP_COUNT], resume_ms[SWEEP_COUNT];
+    int failures = 0;
+
+    for (unsigned i = 0; i < SWEEP_COUNT; ++i) {
+        struct bench_options sweep_options = *options;
+        double total_save = 0, total_resume = 0;
+        unsigned successes = 0;
+
+        sweep_options.state_threads = sweep_thread_counts[i];
+        printf("%d thread(s):\n", sweep_options.state_threads);
+
+        for (unsigned run = 0; run < options->runs; ++run) {
+            double save = -1, resume = run_save_and_resume(&sweep_options, &save);
+
+            if ((resume >= 0) && (save >= 0)) {
+                total_save   += save;
+                total_resume += resume;
+                successes    += 1;
+            }
+        }
+
+        save_ms[i]   = successes ? (total_save / successes) : -1;
+        resume_ms[i] = successes ? (total_resume / successes) : -1;
+        failures    += successes ? 0 : 1;
+    }
+
+    // Resumes are timed to the guest's SSH banner; so they include its boot-to-banner time, too.
+    printf("\n%8s %12s %12s %12s %12s\n", "threads", "save ms", "save MB/s", "resume ms", "resume MB/s");
+    for (unsigned i = 0; i < SWEEP_COUNT; ++i) {
+        if (save_ms[i] < 0) {
+            printf("%8d %12s\n", sweep_thread_counts[i], "failed");
+            continue;
+        }
+
+        printf("%8d %12.1f %12.1f %12.1f %12.1f\n", sweep_thread_counts[i], save_ms[i], ram_mb / (save_ms[i] / 1000.0),
+               resume_ms[i], ram_mb / (resume_ms[i] / 1000.0));
+    }
+
+    return failures;
+}
+
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "usage: %s --qemu <libqemu.so> --kernel <bzImage> --initrd <initrd.img> --disk <disk.qcow>\n"
+        "          [--bios <dir>] [--shared <dir>] [--loadvm <tag>] [--memory <size>]\n"
+        "          [--cpus <n>] [--single-thread] [--disk-iothread]\n"
+        "          [--drive-opt <key=value>]... [--prewarm <ms>] [--runs <n>] [--timeout <seconds>]\n"
+        "          [--save <savevm|state|compressed>] [--memory-file <path>] [--threads <n>]\n"
+        "          [--thread-sweep] [--verbose]\n"
+        "\n"
+        "Boots tctiSH's VM using the app's launcher, and reports the wall time from launch\n"
+        "until the guest's SSH banner appears on port %d. Pass --loadvm to measure a\n"
+        "snapshot resume instead of a cold boot. Pass --prewarm to pre-load the QEMU library\n"
+        "the given number of milliseconds before launching, as the app does during startup.\n"
+        "\n"
+        "With --save, each run boots, saves the VM's state in the given snapshot mode, and then\n"
+        "resumes from it; reporting the save time, the space the state takes up, and the\n"
+        "resume time. 'state' keeps RAM in the --memory-file; 'compressed' uses --threads\n"
+        "threads to compress and decompress RAM.\n"
+        "\n"
+        "With --save compressed --thread-sweep, repeats the save and resume with 1, 2, 4 and 8\n"
+        "threads, and reports the guest RAM each moves in MB/s; e.g. with --memory 2G.\n",
+        name, SSH_FORWARD_PORT);
+}
+
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "qemu",    required_argument, NULL, 'q' },
+        { "kernel",  required_argument, NULL, 'k' },
+        { "initrd",  required_argument, NULL, 'i' },
+        { "bios",    required_argument, NULL, 'b' },
+        { "disk",    required_argument, NULL, 'd' },
+        { "shared",  required_argument, NULL, 's' },
+        { "loadvm",  required_argument, NULL, 'l' },
+        { "memory",  required_argument, NULL, 'm' },
+        { "cpus",    required_argument, NULL, 'c' },
+        { "single-thread", no_argument, NULL, 'S' },
+        { "disk-iothread", no_argument, NULL, 'I' },
+        { "drive-opt", required_argument, NULL, 'o' },
+        { "prewarm", required_argument, NULL, 'p' },
+        { "save",    required_argument, NULL, 'V' },
+        { "memory-file", required_argument, NULL, 'M' },
+        { "threads", required_argument, NULL, 'T' },
+        { "thread-sweep", no_argument,  NULL, 'W' },
+        { "runs",    required_argument, NULL, 'n' },
+        { "timeout", required_argument, NULL, 't' },
+        { "verbose", no_argument,       NULL, 'v' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    struct bench_options options = {
+        .bios_path           = ".",
+        .shared_folder_path  = "/tmp",
+        .memory_value        = "1G",
+        .monitor_socket_path = "/tmp/tctish_bench_monitor.socket",
+        .cpu_count           = 4,
+        .prewarm_ms          = -1,
+        .memory_file_path    = "/tmp/tctish_bench_memory.ram",
+        .state_threads       = 4,
+        .runs                = 1,
+        .timeout_s           = 600,
+    };
+
+    double total = 0, best = -1, worst = -1;
+    unsigned successes = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "q:k:i:b:d:s:l:m:c:SIo:p:V:M:T:Wn:t:vh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'q': options.qemu_library       = optarg; break;
+            case 'k': options.kernel_path        = optarg; break;
+            case 'i': options.initrd_path        = optarg; break;
+            case 'b': options.bios_path          = optarg; break;
+            case 'd': options.disk_path          = optarg; break;
+            case 's': options.shared_folder_path = optarg; break;
+            case 'l': options.boot_image_name    = optarg; break;
+            case 'm': options.memory_value       = optarg; break;
+            case 'c': options.cpu_count          = (int)strtol(optarg, NULL, 0); break;
+            case 'S': options.single_threaded    = true; break;
+            case 'I': options.disk_iothread      = true; break;
+            case 'o':
+                if (options.drive_option_count < (sizeof(options.drive_options) / sizeof(options.drive_options[0]))) {
+                    options.drive_options[options.drive_option_count++] = optarg;
+                }
+                break;
+            case 'p': options.prewarm_ms         = (int)strtol(optarg, NULL, 0); break;
+            case 'V':
+                if (strcmp(optarg, "savevm") == 0) {
+                    options.save_mode = SAVE_SAVEVM;
+                } else if (strcmp(optarg, "state") == 0) {
+                    options.save_mode = SAVE_STATE_FILE;
+                } else if (strcmp(optarg, "compressed") == 0) {
+                    options.save_mode = SAVE_COMPRESSED;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'M': options.memory_file_path   = optarg; break;
+            case 'T': options.state_threads      = (int)strtol(optarg, NULL, 0); break;
+            case 'W': options.thread_sweep       = true; break;
+            case 'n': options.runs               = (unsigned)strtoul(optarg, NULL, 0); break;
+            case 't': options.timeout_s          = (unsigned)strtoul(optarg, NULL, 0); break;
+            case 'v': options.verbose            = true; break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (!options.qemu_library || !options.kernel_path || !options.initrd_path || !options.disk_path) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    static const char *save_mode_names[] = { "none", "savevm", "state file", "compressed state file" };
+
+    printf("mode: %s, %d vCPU(s), %s TCG, saving: %s\n", options.boot_image_name ? "resume (-loadvm)" : "cold boot",
+           options.cpu_count, options.single_threaded ? "single-threaded" : "multi-threaded",
+           save_mode_names[options.save_mode]);
+
+    // Only compressed saves use more than one thread; so that's all a sweep can compare.
+    if (options.thread_sweep) {
+        if (options.save_mode != SAVE_COMPRESSED) {
+            fprintf(stderr, "--thread-sweep requires --save compressed\n");
+            return 1;
+        }
+        return run_thread_sweep(&options) ? 1 : 0;
+    }
+
+    for (unsigned run = 0; run < options.runs; ++run) {
+        double elapsed = options.save_mode ? run_save_and_resume(&options, NULL) : run_once(&options, NULL, NULL);
+
+        if (elapsed < 0) {
+            printf("run %u: failed\n", run + 1);
+            continue;
+        }
+
+        printf("run %u: %.1f ms to SSH banner\n", run + 1, elapsed);
+
+        total += elapsed;
+        successes += 1;
+        if ((best < 0) || (elapsed < best)) {
+            best = elapsed;
+        }
+        if (elapsed > worst) {
+            worst = elapsed;
+        }
+    }
+
+    if (successes == 0) {
+        return 1;
+    }
+
+    printf("runs: %u/%u  min: %.1f ms  mean: %.1f ms  max: %.1f ms\n",
+           successes, options.runs, best, total / successes, worst);
+    return (successes == options.runs) ? 0 : 1;
+}
@@ -1,6 +1,13 @@
 //! Protocol for communicating with the tctiSH host.
+//!
+//! Messages are newline-delimited JSON. A connection can carry any number of requests, which the host
+//! handles in order; each request can carry an ID, which the host repeats in its response.
+//!
+//! Inside tctiSH, we talk to the host over a virtio-serial port when we can; and fall back to TCP (through
+//! QEMU's emulated networking) when we can't, e.g. because another process is already using the port.
 
-use std::{net::TcpStream, io::BufRead, time::Duration, io::{BufReader, Write}};
+use std::{cell::RefCell, collections::HashSet, fs::File, net::TcpStream, process, sync::mpsc, thread, time::Duration};
+use std::io::{self, BufRead, BufReader, Read, Write};
 
 use anyhow::{Result, anyhow};
 use serde::{Serialize, Deserialize};
@@ -11,6 +18,13 @@ const CONFIGURATION_HOST_ADDRESS : &str = "localhost:10050";
 #[cfg(target_os = "linux")]
 const CONFIGURATION_HOST_ADDRESS : &str = "192.168.100.2:10050";
 
+/// The virtio-serial port that carries our control channel, inside tctiSH.
+#[cfg(target_os = "linux")]
+const CONTROL_PORT_PATH : &str = "/dev/virtio-ports/org.tctish.control";
+
+/// How long we'll wait for the host to answer on our control channel, before we fall back to TCP.
+const CONTROL_PORT_HANDSHAKE_TIMEOUT : Duration = Duration::from_millis(500);
+
 /// Message exchanged back and forth with our 
 #[derive(Debug, Serialize, Deserialize)]
 pub(crate) struct ConfigurationMessage {
@@ -22,38 +36,196 @@ pub(crate) struct ConfigurationMessage {
     pub key: Option<String>,
 
     /// The argument to the message.
-    pub value: Option<String>
+    pub value: Option<String>,
 
+    /// Identifies a request, so its response can be matched to it; the host repeats it back.
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub id: Option<String>,
 }
 
-/// Sends a command message to the host, and receives a response.
-pub(crate) fn exchange_message(message: ConfigurationMessage) -> Result<ConfigurationMessage> {
 
-    // Get a connection to our ConfigServer...
-    let mut socket = TcpStream::connect(CONFIGURATION_HOST_ADDRESS)?;
-    let mut socket_reader = BufReader::new(socket.try_clone()?);
+/// The channel a connection to our ConfigServer runs over.
+pub(crate) enum Transport {
+    Serial(File),
+    Tcp(TcpStream),
+}
+
+impl Transport {
+    fn try_clone(&self) -> io::Result<Transport> {
+        match self {
+            Transport::Serial(port) => Ok(Transport::Serial(port.try_clone()?)),
+            Transport::Tcp(stream) => Ok(Transport::Tcp(stream.try_clone()?)),
+        }
+    }
+}
+
+impl Read for Transport {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        match self {
+            Transport::Serial(port) => port.read(buf),
+            Transport::Tcp(stream) => stream.read(buf),
+        }
+    }
+}
 
-    // ... cajole our message into being JSON, and splat it up to the host.
-    let raw_message = serde_json::to_string(&message)? + "\n";
-    let size_written = socket.write(&raw_message.into_bytes());
-    if size_written.is_err() || (size_written.unwrap() == 0){
-        return Err(anyhow!("response error'd out without data"));
+impl Write for Transport {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        match self {
+            Transport::Serial(port) => port.write(buf),
+            Transport::Tcp(stream) => stream.write(buf),
+        }
     }
 
-    // Every packet from the ConfigServer should have a response; try to read it.
-    let mut raw_response = String::new();
-    let size_read = socket_reader.read_line(&mut raw_response);
-    if size_read.is_err() || (size_read.unwrap() == 0){
-        return Err(anyhow!("response error'd out without data"));
+    fn flush(&mut self) -> io::Result<()> {
+        match self {
+            Transport::Serial(port) => port.flush(),
+            Transport::Tcp(stream) => stream.flush(),
+        }
     }
+}
 
-    // Finally, fetch a response, if we have one.
-    let response : ConfigurationMessage = serde_json::from_str(&raw_response)?;
 
-    // If we received an error response from the host, translate it into an error.
+/// A connection to our ConfigServer, which can be reused for any number of requests.
+pub(crate) struct Connection {
+
+    /// The channel we send requests on...
+    writer: Transport,
+
+    /// ... and the same channel, buffered for reading responses.
+    reader: BufReader<Transport>,
+
+    /// The ID we'll give our next request.
+    next_id: u64,
+
+    /// True iff responses must carry the ID of the request they answer. Our serial port is shared by everyone in
+    /// the guest, and may still hold responses meant for a process that's since gone away; so there, responses
+    /// without our IDs aren't ours.
+    require_ids: bool,
+}
+
+impl Connection {
+
+    /// Connects to our ConfigServer; over our control channel if we can, or over TCP if we can't.
+    pub(crate) fn open() -> Result<Connection> {
+        if let Some(connection) = Self::open_control_port() {
+            return Ok(connection);
+        }
+
+        Self::open_tcp()
+    }
+
+    /// Connects to our ConfigServer over TCP; e.g. for connections that stay open, which shouldn't tie up the
+    /// control channel everyone else in the guest shares.
+    pub(crate) fn open_tcp() -> Result<Connection> {
+        Self::over(Transport::Tcp(TcpStream::connect(CONFIGURATION_HOST_ADDRESS)?), false)
+    }
+
+    /// Creates a connection over the given channel.
+    fn over(transport: Transport, require_ids: bool) -> Result<Connection> {
+        let reader = BufReader::new(transport.try_clone()?);
+        Ok(Connection { writer: transport, reader, next_id: 0, require_ids })
+    }
+
+    /// Connects to our ConfigServer over our virtio-serial control channel; if it's there, free, and answering.
+    #[cfg(target_os = "linux")]
+    fn open_control_port() -> Option<Connection> {
+
+        // Only one process can have the port open at a time; anyone else gets an error, and uses TCP.
+        let port = File::options().read(true).write(true).open(CONTROL_PORT_PATH).ok()?;
+        let mut connection = Self::over(Transport::Serial(port), true).ok()?;
+
+        // Someone before us may have left a partial message in the port; ending it lets ours start cleanly.
+        connection.writer.write_all(b"\n").ok()?;
+
+        // The port opens fine even when the host isn't listening on its end; so make sure the host answers,
+        // before we commit to it.
+        let (sender, receiver) = mpsc::channel();
+        thread::spawn(move || {
+            let result = connection.exchange(ConfigurationMessage { command: "echo".to_owned(), key: None, value: None, id: None });
+            let _ = sender.send(result.map(|_| connection));
+        });
+
+        receiver.recv_timeout(CONTROL_PORT_HANDSHAKE_TIMEOUT).ok()?.ok()
+    }
+
+    /// Outside of tctiSH, there's no control channel; so we always use TCP.
+    #[cfg(not(target_os = "linux"))]
+    fn open_control_port() -> Option<Connection> {
+        None
+    }
+
+    /// Sends a request without waiting for its response, tagging it with an ID if it doesn't have one.
+    /// Returns the request's ID.
+    pub(crate) fn send(&mut self, mut message: ConfigurationMessage) -> Result<String> {
+        let id = message.id.get_or_insert_with(|| {
+            self.next_id += 1;
+            unique_request_id(self.next_id)
+        }).clone();
+
+        // Cajole our message into being JSON, and splat it up to the host.
+        let raw_message = serde_json::to_string(&message)? + "\n";
+        self.writer.write_all(raw_message.as_bytes())?;
+
+        Ok(id)
+    }
+
+    /// Receives the next message from the host. Responses arrive in the order their requests were sent; on a
+    /// subscribed connection, they're interleaved with events.
+    pub(crate) fn receive(&mut self) -> Result<ConfigurationMessage> {
+        let mut raw_response = String::new();
+        let size_read = self.reader.read_line(&mut raw_response)?;
+        if size_read == 0 {
+            return Err(anyhow!("host closed the connection without responding"));
+        }
+
+        Ok(serde_json::from_str(&raw_response)?)
+    }
+
+    /// Receives the next response to one of the given requests; skipping any that aren't ours.
+    pub(crate) fn receive_for(&mut self, ids: &HashSet<String>) -> Result<ConfigurationMessage> {
+        loop {
+            let response = self.receive()?;
+
+            // Hosts from before request IDs don't send any back; but we can only get those over TCP.
+            match &response.id {
+                Some(id) if ids.contains(id) => return Ok(response),
+                None if !self.require_ids => return Ok(response),
+                _ => continue,
+            }
+        }
+    }
+
+    /// Sends a request, and waits for its response.
+    pub(crate) fn exchange(&mut self, message: ConfigurationMessage) -> Result<ConfigurationMessage> {
+        let id = self.send(message)?;
+        self.receive_for(&HashSet::from([id]))
+    }
+
+    /// Returns a clone of the channel we send requests on; e.g. so requests can be sent from another thread,
+    /// while this one reads responses.
+    pub(crate) fn try_clone_writer(&self) -> Result<Transport> {
+        Ok(self.writer.try_clone()?)
+    }
+}
+
+
+/// Creates a request ID that no other process in the guest will use; since we may share a channel with them.
+fn unique_request_id(sequence: u64) -> String {
+    format!("{}-{}", process::id(), sequence)
+}
+
+
+thread_local! {
+    /// The connection our commands share, once one's been opened.
+    static SHARED_CONNECTION : RefCell<Option<Connection>> = RefCell::new(None);
+}
+
+
+/// Translates an error response from the host into an error.
+pub(crate) fn check_response(response: ConfigurationMessage) -> Result<ConfigurationMessage> {
     if let Some(key) = &response.key {
         if key == "error" {
-            return Err(anyhow!("error response: ".to_owned() + &response.value.unwrap()));
+            return Err(anyhow!("error response: ".to_owned() + response.value.as_deref().unwrap_or("")));
         }
     }
 
@@ -61,9 +233,71 @@ pub(crate) fn exchange_message(message: ConfigurationMessage) -> Result<Configur
 }
 
 
+/// Sends a command message to the host, and receives a response.
+/// Commands share a single connection; so a run of them only pays to connect once.
+pub(crate) fn exchange_message(message: ConfigurationMessage) -> Result<ConfigurationMessage> {
+    SHARED_CONNECTION.with(|shared| {
+        let mut shared = shared.borrow_mut();
+
+        // Get a connection to our ConfigServer, if we don't have one already...
+        if shared.is_none() {
+            *shared = Some(Connection::open()?);
+        }
+
+        // ... and exchange our message over it. If that fails, the connection is no good to anyone after us.
+        let result = shared.as_mut().unwrap().exchange(message);
+        if result.is_err() {
+            *shared = None;
+        }
+
+        check_response(result?)
+    })
+}
+
+
 /// Sends a command message to the host, and receives a response.
 pub(crate) fn run_command(command: String, key: Option<String>, value: Option<String>) -> Result<ConfigurationMessage> {
-    let message = ConfigurationMessage{ command, key, value };
+    let message = ConfigurationMessage{ command, key, value, id: None };
     exchange_message(message)
 }
 
+
+/// Reads requests from stdin, one JSON message per line, and pipelines them all over a single connection;
+/// printing each response as a line of JSON, in order. Lets scripts issue many commands without connecting for each.
+pub(crate) fn run_batch() -> Result<()> {
+    let mut connection = Connection::open()?;
+
+    let mut requests = Vec::new();
+    let mut ids = HashSet::new();
+    for line in io::stdin().lock().lines() {
+        let line = line?;
+        if line.trim().is_empty() {
+            continue;
+        }
+
+        let mut message = serde_json::from_str::<ConfigurationMessage>(&line)?;
+        ids.insert(message.id.get_or_insert_with(|| {
+            connection.next_id += 1;
+            unique_request_id(connection.next_id)
+        }).clone());
+        requests.push(message);
+    }
+    let request_count = requests.len();
+
+    // Send from another thread; so a long batch can't fill up the connection while we're not reading responses.
+    let mut writer = connection.try_clone_writer()?;
+    let sender = thread::spawn(move || -> Result<()> {
+        for message in requests {
+            writer.write_all((serde_json::to_string(&message)? + "\n").as_bytes())?;
+        }
+        Ok(())
+    });
+
+    for _ in 0..request_count {
+        let response = connection.receive_for(&ids)?;
+        println!("{}", serde_json::to_string(&response)?);
+    }
+
+    sender.join().map_err(|_| anyhow!("request sender panicked"))??;
+    Ok(())
+}
@@ -0,0 +1,15 @@
+//! Commands for managing tctiSH's persistent disk.
+
+use anyhow::Result;
+
+use crate::comms::run_command;
+
+/// The command used to detach a thin disk from its base image.
+const COMMAND_DISK_FLATTEN : &str = "disk_flatten";
+
+
+/// Asks the host to copy everything our disk reads from its base image into the disk itself.
+/// The copy happens in the background; the disk stays usable throughout.
+pub(crate) fn flatten_disk() -> Result<()> {
+    run_command(COMMAND_DISK_FLATTEN.to_owned(), None, None).map(|_| ())
+}
@@ -3,9 +3,12 @@
  */
 
 mod comms;
+mod disk;
 mod mount;
 mod simple;
+mod snapshot;
 mod ui;
+mod watch;
 
 use clap::{Parser, Subcommand};
 
@@ -47,6 +50,27 @@ enum Commands {
         mountpoint: String
     },
 
+    #[clap(about ="Manage the persistent disk")]
+    Disk {
+        #[clap(subcommand)]
+        subcommand: DiskCommands,
+    },
+
+    #[clap(about ="Inspect and clean up saved VM states")]
+    Snapshot {
+        #[clap(subcommand)]
+        subcommand: SnapshotCommands,
+    },
+
+    #[clap(about ="Prints host events (e.g. mount_ready, terminal_resized, app_background) as they happen")]
+    Watch {
+        #[clap(help ="The events to watch for; or all of them, if none are given")]
+        events: Vec<String>,
+
+        #[clap(long, help ="Exit after the first event")]
+        once: bool,
+    },
+
     // Low-level commands not used by typical users.
     #[clap(about ="Commands that directly poke the configuration server's internals")]
     Lowlevel {
@@ -56,6 +80,37 @@ enum Commands {
 }
 
 
+#[derive(Debug, Subcommand)]
+enum DiskCommands {
+
+    #[clap(about ="Copies a thin disk's base image into the disk, so it stands alone; runs in the background")]
+    Flatten {},
+}
+
+
+#[derive(Debug, Subcommand)]
+enum SnapshotCommands {
+
+    #[clap(about ="Lists saved VM states, with their sizes and save/restore times")]
+    List {},
+
+    #[clap(about ="Saves the VM's state into a named snapshot")]
+    Save {
+        #[clap(help ="The name to save the snapshot as")]
+        name: String
+    },
+
+    #[clap(about ="Deletes a saved VM state")]
+    Rm {
+        #[clap(help ="The name of the snapshot to delete")]
+        name: String
+    },
+
+    #[clap(about ="Shows how much storage saved VM states are using")]
+    Stats {},
+}
+
+
 #[derive(Debug, Subcommand)]
 enum LowlevelCommands {
 
@@ -73,6 +128,9 @@ enum LowlevelCommands {
         value: Option<String>
     },
 
+    #[clap(about ="Issues API commands read from stdin, one JSON message per line, over a single connection")]
+    Batch {},
+
     #[clap(about ="Prepares a host directory to be mounted into tctiSH")]
     PrepareMount {
         ios_path: String
@@ -87,6 +145,9 @@ enum LowlevelCommands {
 
     #[clap(about ="Fetches the host's perspective on our CWD.")]
     GetCWD {},
+
+    #[clap(about ="Fetches the number of times QEMU has flushed its translated-code cache.")]
+    JitStats {},
 }
 
 //
@@ -125,6 +186,38 @@ fn main() {
 
         }
 
+        // Persistent disk management.
+        Commands::Disk { subcommand } => {
+            let result = match subcommand {
+                DiskCommands::Flatten {} => disk::flatten_disk(),
+            };
+
+            if let Err(err) = result {
+                eprintln!("Disk command failed: {}", err);
+            }
+        }
+
+        // Saved-state management.
+        Commands::Snapshot { subcommand } => {
+            let result = match subcommand {
+                SnapshotCommands::List {} => snapshot::handle_snapshot_list(),
+                SnapshotCommands::Save { name } => snapshot::save_snapshot(name),
+                SnapshotCommands::Rm { name } => snapshot::delete_snapshot(name),
+                SnapshotCommands::Stats {} => snapshot::handle_snapshot_stats(),
+            };
+
+            if let Err(err) = result {
+                eprintln!("Snapshot command failed: {}", err);
+            }
+        }
+
+        // Host event stream.
+        Commands::Watch { events, once } => {
+            if let Err(err) = watch::handle_watch(events, once) {
+                eprintln!("Couldn't watch for host events: {}", err);
+            }
+        }
+
         // General low-level subcommands.
         Commands::Lowlevel { subcommand } => {
             lowlevel(subcommand)
@@ -144,6 +237,12 @@ fn lowlevel(subcommand: LowlevelCommands) {
             dbg!(result);
         }
 
+        LowlevelCommands::Batch {} => {
+            if let Err(err) = comms::run_batch() {
+                eprintln!("Batch failed: {}", err);
+            }
+        }
+
         LowlevelCommands::PrepareMount { ios_path } => {
             let result = mount::prepare_mount_from_path(ios_path);
             dbg!(result);
@@ -172,6 +271,17 @@ fn lowlevel(subcommand: LowlevelCommands) {
             }
         }
 
+        LowlevelCommands::JitStats {} => {
+            match simple::handle_jit_stats() {
+                Ok(flushes) => {
+                    println!("TB flush count: {}", flushes);
+                }
+                Err(err) => {
+                    eprintln!("Couldn't get JIT statistics: {}", err);
+                }
+            }
+        }
+
 
     }
 
@@ -1,5 +1,5 @@
 ///! Commands for mounting iOS folders into the tctiSH guest.
-use std::{fs, thread, time::Duration};
+use std::{fs, path::Path, thread, time::{Duration, Instant}};
 
 use anyhow::{Result, anyhow};
 use sys_mount::{FilesystemType, Mount, MountFlags};
@@ -16,9 +16,14 @@ const MOUNT_ALLOWED : bool = true;
 /// Options used when mounting host filesystems.
 const HOST_MOUNT_OPTIONS : &str = "trans=virtio,version=9p2000.L,debug=0x40";
 
-/// The delay between a successful prepare_mount() and returning.
-/// Gives QEMU time to actually make things available.
-const PREPARE_MOUNT_DELAY : Duration =  Duration::new(1, 0);
+/// Where the host's shared folder is mounted in the guest; each prepared mount appears inside it, under its tag.
+const HOST_SHARE_PATH : &str = "/ios_host";
+
+/// How long we'll wait for a mount the host says is ready to show up in our view of its shared folder.
+const MOUNT_READY_TIMEOUT : Duration = Duration::from_secs(2);
+
+/// How often we look for it, while we wait.
+const MOUNT_READY_POLL_INTERVAL : Duration = Duration::from_millis(5);
 
 /// Handles the "mount" command.
 pub(crate) fn mount_from_host(host_bookmark: String, guest_path: String) -> Result<()> {
@@ -30,7 +35,6 @@ pub(crate) fn mount_from_host(host_bookmark: String, guest_path: String) -> Resu
 
     // Set up mounting from inside the guest...
     let mount_tag = prepare_mount_from_bookmark(host_bookmark, guest_path).expect("failed to prepare mount from host!");
-    scan_for_new_virtfs_channels().expect("could not set up guest to receive mount!");
 
     // ... and perform the mount itself.
     /*
@@ -55,16 +59,32 @@ pub(crate) fn mount_from_host(host_bookmark: String, guest_path: String) -> Resu
 /// Argtype should indicate if this is a 'path' or a 'bookmark' using those strings.
 /// Returns a tag that can be used to mount the given folder using 9pfs.
 fn prepare_mount(mount_arg: String, argName: String) -> Result<String> {
-    let response = run_command("prepare_mount".to_owned(), Some(argName.to_owned()), Some(mount_arg));
-    match response {
-        Ok(message) => {
-            thread::sleep(PREPARE_MOUNT_DELAY);
-            return Ok(message.value.expect("did not receive a mount path in response!"));
-        }
-        Err(err) => {
-            return Err(err);
+    let response = run_command("prepare_mount".to_owned(), Some(argName.to_owned()), Some(mount_arg))?;
+    let tag = response.value.ok_or(anyhow!("did not receive a mount path in response!"))?;
+
+    // The host only responds once the mount is ready; make sure we can see it too, before anyone tries to use it.
+    if MOUNT_ALLOWED {
+        wait_for_mount(&tag)?;
+    }
+
+    Ok(tag)
+}
+
+
+/// Waits for a mount the host has prepared to appear in our view of its shared folder; which our 9p client
+/// may take a moment to notice.
+fn wait_for_mount(tag: &str) -> Result<()> {
+    let path = Path::new(HOST_SHARE_PATH).join(tag);
+    let deadline = Instant::now() + MOUNT_READY_TIMEOUT;
+
+    while fs::metadata(&path).is_err() {
+        if Instant::now() >= deadline {
+            return Err(anyhow!("host prepared mount {}, but it never appeared in {}", tag, HOST_SHARE_PATH));
         }
+        thread::sleep(MOUNT_READY_POLL_INTERVAL);
     }
+
+    Ok(())
 }
 
 
@@ -79,16 +99,3 @@ pub(crate) fn prepare_mount_from_path(host_path: String) -> Result<String> {
 pub(crate) fn prepare_mount_from_bookmark(bookmark: String, name: String) -> Result<String> {
     prepare_mount(bookmark, name) 
 }
-
-
-/// Requests that the guest check for new PCI(e) channels with which it can
-/// establish 9pfs connections, for mounting host filesystems.
-fn scan_for_new_virtfs_channels() -> Result<()> {
-    let result = fs::write("/sys/bus/pci/rescan", "1");
-    if let Err(result) = result {
-        return Err(anyhow!(format!("could not rescan PCI(e) devices: {}", result)));
-    }
-
-    Ok(())
-}
-
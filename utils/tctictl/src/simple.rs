@@ -10,6 +10,9 @@ const COMMAND_FONT: &str = "font";
 /// The command used to get the current working directory.
 const COMMAND_GETCWD : &str = "getcwd";
 
+/// The command used to get translated-code cache statistics.
+const COMMAND_JIT_STATS : &str = "jit_stats";
+
 /// Returns a given tctiSH font property.
 fn get_font_property(property: &str) -> Result<String> {
     return Ok("<TODO>".to_owned())
@@ -68,3 +71,10 @@ pub(crate) fn handle_getcwd() -> Result<String> {
         }
     }
 }
+
+
+/// Fetches the number of times QEMU has flushed its translated-code cache.
+pub(crate) fn handle_jit_stats() -> Result<String> {
+    let response = run_command(COMMAND_JIT_STATS.to_owned(), None, None)?;
+    response.value.ok_or(anyhow!("response didn't include a flush count"))
+}
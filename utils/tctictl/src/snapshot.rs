@@ -0,0 +1,183 @@
+//! Commands for inspecting and cleaning up tctiSH's saved VM states.
+
+use anyhow::{Result, anyhow};
+use serde::Deserialize;
+
+use crate::comms::run_command;
+
+/// The command used to list our saved states.
+const COMMAND_SNAPSHOT_LIST : &str = "snapshot_list";
+
+/// The command used to save a named state.
+const COMMAND_SNAPSHOT_SAVE : &str = "snapshot_save";
+
+/// The command used to delete a saved state.
+const COMMAND_SNAPSHOT_DELETE : &str = "snapshot_delete";
+
+/// The command used to get storage statistics for our saved states.
+const COMMAND_SNAPSHOT_STATS : &str = "snapshot_stats";
+
+/// A saved VM state, as described by the host's snapshot catalog.
+#[derive(Debug, Deserialize)]
+pub(crate) struct SnapshotInfo {
+
+    /// The snapshot's name; the host's state-file save is listed as "@state_file".
+    pub name: String,
+
+    /// How many bytes of VM state the snapshot holds.
+    pub vm_state_size: u64,
+
+    /// When the snapshot was taken, in seconds since the epoch; or zero if unknown.
+    pub date: u64,
+
+    /// How long the snapshot took to save, and to restore, in milliseconds; if the host has timed it.
+    pub save_ms: Option<f64>,
+    pub load_ms: Option<f64>,
+
+    /// False if the snapshot can't be resumed from.
+    pub complete: bool,
+
+    /// How much RAM the guest was using before and after the host trimmed it for the save, in bytes; if it did.
+    pub ram_before_trim: Option<u64>,
+    pub ram_after_trim: Option<u64>,
+
+    /// True iff this is the snapshot the host will resume from next.
+    pub resume_image: bool,
+}
+
+/// A summary of how much storage our saved states are using.
+#[derive(Debug, Deserialize)]
+pub(crate) struct SnapshotStats {
+    pub snapshot_count: usize,
+    pub vm_state_bytes: u64,
+    pub disk_file_bytes: u64,
+    pub state_file_bytes: u64,
+    pub memory_file_bytes: u64,
+
+    /// How many saves the host has made in its current snapshot mode with the guest's RAM trimmed first, and without;
+    /// and the average size of the state each wrote, in bytes. Older hosts don't report these.
+    #[serde(default)]
+    pub trimmed_save_count: usize,
+    #[serde(default)]
+    pub trimmed_save_bytes: Option<u64>,
+    #[serde(default)]
+    pub untrimmed_save_count: usize,
+    #[serde(default)]
+    pub untrimmed_save_bytes: Option<u64>,
+}
+
+
+/// Formats a byte count for humans.
+fn format_size(bytes: u64) -> String {
+    const UNITS : [&str; 4] = ["KiB", "MiB", "GiB", "TiB"];
+
+    let mut size = bytes as f64;
+    let mut unit = "B";
+    for next_unit in UNITS {
+        if size < 1024.0 {
+            break;
+        }
+        size /= 1024.0;
+        unit = next_unit;
+    }
+
+    format!("{:.1} {}", size, unit)
+}
+
+/// Formats an optional duration in milliseconds for humans.
+fn format_duration(ms: Option<f64>) -> String {
+    match ms {
+        Some(ms) => format!("{:.2} s", ms / 1000.0),
+        None => "-".to_owned()
+    }
+}
+
+
+/// Formats the average size of a set of saves, for humans.
+fn format_average_save(count: usize, bytes: Option<u64>) -> String {
+    match bytes {
+        Some(bytes) => format!("{} average, over {} saves", format_size(bytes), count),
+        None => "no saves yet".to_owned()
+    }
+}
+
+
+/// Formats how far a snapshot's RAM was trimmed before it was saved, for humans.
+fn format_trim(before: Option<u64>, after: Option<u64>) -> String {
+    match (before, after) {
+        (Some(before), Some(after)) => format!("{} -> {}", format_size(before), format_size(after)),
+        _ => "-".to_owned()
+    }
+}
+
+
+/// Fetches the host's snapshot catalog.
+pub(crate) fn list_snapshots() -> Result<Vec<SnapshotInfo>> {
+    let response = run_command(COMMAND_SNAPSHOT_LIST.to_owned(), None, None)?;
+    let encoded = response.value.ok_or(anyhow!("response didn't include a snapshot list"))?;
+    Ok(serde_json::from_str(&encoded)?)
+}
+
+/// Fetches storage statistics for the host's saved states.
+pub(crate) fn get_snapshot_stats() -> Result<SnapshotStats> {
+    let response = run_command(COMMAND_SNAPSHOT_STATS.to_owned(), None, None)?;
+    let encoded = response.value.ok_or(anyhow!("response didn't include snapshot statistics"))?;
+    Ok(serde_json::from_str(&encoded)?)
+}
+
+/// Asks the host to save the VM's state into a named snapshot; returning once the save is done.
+pub(crate) fn save_snapshot(name: String) -> Result<()> {
+    run_command(COMMAND_SNAPSHOT_SAVE.to_owned(), None, Some(name)).map(|_| ())
+}
+
+/// Asks the host to delete a saved state.
+pub(crate) fn delete_snapshot(name: String) -> Result<()> {
+    run_command(COMMAND_SNAPSHOT_DELETE.to_owned(), None, Some(name)).map(|_| ())
+}
+
+
+/// Prints the host's snapshot catalog.
+pub(crate) fn handle_snapshot_list() -> Result<()> {
+    let snapshots = list_snapshots()?;
+
+    println!("{:<24} {:>12} {:>10} {:>10} {:>24}  {}", "NAME", "VM STATE", "SAVE", "RESTORE", "RAM TRIMMED", "STATUS");
+    for snapshot in snapshots {
+
+        // Flag the snapshot we'll resume from, and any we can't.
+        let mut status = Vec::new();
+        if snapshot.resume_image {
+            status.push("resume");
+        }
+        if !snapshot.complete {
+            status.push("incomplete");
+        }
+
+        println!("{:<24} {:>12} {:>10} {:>10} {:>24}  {}", snapshot.name, format_size(snapshot.vm_state_size),
+                 format_duration(snapshot.save_ms), format_duration(snapshot.load_ms),
+                 format_trim(snapshot.ram_before_trim, snapshot.ram_after_trim), status.join(","));
+    }
+
+    Ok(())
+}
+
+/// Prints storage statistics for the host's saved states.
+pub(crate) fn handle_snapshot_stats() -> Result<()> {
+    let stats = get_snapshot_stats()?;
+
+    println!();
+    println!("Saved states:");
+    println!("    snapshots   = {}", stats.snapshot_count);
+    println!("    VM state    = {}", format_size(stats.vm_state_bytes));
+    println!();
+    println!("Host storage used:");
+    println!("    disk image  = {}", format_size(stats.disk_file_bytes));
+    println!("    state file  = {}", format_size(stats.state_file_bytes));
+    println!("    memory file = {}", format_size(stats.memory_file_bytes));
+    println!();
+    println!("State written per save:");
+    println!("    trimmed     = {}", format_average_save(stats.trimmed_save_count, stats.trimmed_save_bytes));
+    println!("    untrimmed   = {}", format_average_save(stats.untrimmed_save_count, stats.untrimmed_save_bytes));
+    println!();
+
+    Ok(())
+}
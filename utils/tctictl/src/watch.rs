@@ -0,0 +1,72 @@
+//! Streams host events to guest scripts; so they can react to the host, rather than polling it.
+
+use std::io::{self, Write};
+
+use anyhow::Result;
+
+use crate::comms::{Connection, ConfigurationMessage, check_response};
+
+/// The command used to subscribe to host events.
+const COMMAND_SUBSCRIBE : &str = "subscribe";
+
+/// The command the host uses for the events it pushes to us.
+const COMMAND_EVENT : &str = "event";
+
+/// A single event pushed by the host.
+pub(crate) struct HostEvent {
+
+    /// The event's name; e.g. "mount_ready".
+    pub name: String,
+
+    /// Any details that came with the event; e.g. the tag of the mount that's ready.
+    pub value: Option<String>,
+}
+
+
+/// Subscribes to the given host events; or to all of them, if none are given.
+/// The subscription lasts as long as the returned connection.
+pub(crate) fn subscribe(events: &[String]) -> Result<Connection> {
+
+    // Subscriptions hold their connection open for as long as they last; so never use the shared control channel.
+    let mut connection = Connection::open_tcp()?;
+
+    let value = if events.is_empty() { None } else { Some(events.join(",")) };
+    let request = ConfigurationMessage { command: COMMAND_SUBSCRIBE.to_owned(), key: None, value, id: None };
+    check_response(connection.exchange(request)?)?;
+
+    Ok(connection)
+}
+
+/// Waits for the next event on a subscribed connection.
+pub(crate) fn next_event(connection: &mut Connection) -> Result<HostEvent> {
+    loop {
+        let message = connection.receive()?;
+        if message.command != COMMAND_EVENT {
+            continue;
+        }
+
+        return Ok(HostEvent { name: message.key.unwrap_or_default(), value: message.value });
+    }
+}
+
+
+/// Handles the "watch" command: prints each event as it arrives, one per line, as "<event> [<value>]".
+/// With `once`, exits after the first event; so scripts can wait on something, rather than sleeping and retrying.
+pub(crate) fn handle_watch(events: Vec<String>, once: bool) -> Result<()> {
+    let mut connection = subscribe(&events)?;
+
+    loop {
+        let event = next_event(&mut connection)?;
+        match event.value {
+            Some(value) => println!("{} {}", event.name, value),
+            None => println!("{}", event.name),
+        }
+
+        // Scripts are usually reading us through a pipe; so make sure each event gets to them right away.
+        io::stdout().flush()?;
+
+        if once {
+            return Ok(());
+        }
+    }
+}